@@ -0,0 +1,401 @@
+// Headless end-to-end search benchmark.
+//
+// Drives data_sink_sources_execute_search with synthetic in-process providers,
+// through the thread pool shard fan-out and merge_hashset_parallel, up to the
+// point where the merged set would be handed to the UI. Every thread count is
+// measured in a forked child so the pool is sized fresh for each run.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <glib.h>
+
+#include "data-sink-sources.h"
+#include "hashset.h"
+#include "events.h"
+#include "path-corpus.h"
+#include "signature-index.h"
+
+extern int thread_pool_num_cores(void);
+extern void thread_pool_init(uint16_t n);
+extern void thread_pool_run(void (*func)(void*), void* data, void (*free_func)(void*));
+
+typedef struct _BobLauncherPluginBase BobLauncherPluginBase;
+
+#define SEARCHING_FOR_SOURCES 1
+#define SEARCHING_FOR_COUNT 5
+#define MAX_THREAD_COUNTS 16
+
+typedef struct {
+    GRegex* regex;
+    guint shard_count;
+    gboolean refine;
+    int generation;
+    char** items;
+    uint64_t* signatures;
+    PathCorpus* corpus;
+    SignatureIndex* index;
+    int n_items;
+} BenchProvider;
+
+static int opt_items = 200000;
+static int opt_shards = 8;
+static int opt_providers = 2;
+static int opt_rounds = 20;
+static bool opt_refine = false;
+static bool opt_corpus = false;
+static bool opt_index = false;
+static int opt_publish = 0;
+static bool opt_help = false;
+static int opt_threads[MAX_THREAD_COUNTS];
+static int opt_thread_counts = 0;
+
+static const char* const words[] = {
+    "home", "user", "src", "include", "lib", "share", "config", "local", "cache", "build",
+    "launcher", "plugins", "desktop", "applications", "icons", "documents", "downloads",
+    "music", "pictures", "projects", "notes", "backup", "release", "debug", "test",
+    "main", "utils", "search", "result", "container", "thread", "manager", "window",
+};
+
+static const char* const extensions[] = {
+    "c", "h", "vala", "txt", "md", "png", "svg", "desktop", "json", "xml",
+};
+
+static const char* const queries[] = {
+    "launcher", "srcmain", "config utils", "resultcontainer.c", "desktop",
+};
+
+#define N_WORDS (sizeof(words) / sizeof(words[0]))
+#define N_EXTENSIONS (sizeof(extensions) / sizeof(extensions[0]))
+#define N_QUERIES (sizeof(queries) / sizeof(queries[0]))
+
+// === State and provider entry points used by data-sink-sources.c ===
+
+GPtrArray* plugin_loader_default_search_providers = NULL;
+HashSet** state_providers = NULL;
+int* state_selected_indices = NULL;
+
+static int published_event = -1;
+
+int state_update_provider(int what, HashSet* new_provider, int selected_index) {
+    state_selected_indices[what] = selected_index;
+
+    HashSet* old = state_providers[what];
+    state_providers[what] = new_provider;
+    thread_pool_run((void (*)(void*))hashset_destroy, old, NULL);
+
+    published_event = new_provider->event_id;
+    return 1;
+}
+
+void state_update_layout(int what) {
+    (void)what;
+}
+
+gint16 bob_launcher_plugin_base_get_bonus(BobLauncherPluginBase* self) {
+    (void)self;
+    return 0;
+}
+
+GRegex* bob_launcher_search_base_get_compiled_regex(BobLauncherSearchBase* self) {
+    return ((BenchProvider*)self)->regex;
+}
+
+guint bob_launcher_search_base_get_shard_count(BobLauncherSearchBase* self) {
+    return ((BenchProvider*)self)->shard_count;
+}
+
+guint bob_launcher_search_base_get_update_interval(BobLauncherSearchBase* self) {
+    (void)self;
+    return 0;
+}
+
+gboolean bob_launcher_search_base_get_supports_refinement(BobLauncherSearchBase* self) {
+    return ((BenchProvider*)self)->refine;
+}
+
+gint bob_launcher_search_base_get_candidate_generation(BobLauncherSearchBase* self) {
+    return ((BenchProvider*)self)->generation;
+}
+
+static void* bench_match_factory(void* user_data) {
+    (void)user_data;
+    return NULL;
+}
+
+static void score_item(BenchProvider* p, ResultContainer* rs, uint32_t i) {
+    const char* item = p->items[i];
+    int32_t score;
+
+    if (p->refine) {
+        if (!result_container_may_match(rs, p->signatures[i])) return;
+        if (!result_container_match_candidate(rs, i, item, &score)) return;
+    } else {
+        if (!result_container_has_match_signed(rs, item, p->signatures[i])) return;
+        score = result_container_match_score_pruned(rs, item);
+    }
+
+    result_container_add_lazy_unique(rs, score, (MatchFactory)bench_match_factory, (void*)(uintptr_t)i, NULL);
+}
+
+static void score_candidates(BenchProvider* p, ResultContainer* rs, const uint32_t* candidates, int n) {
+    for (int i = 0; i < n; i++) {
+        if ((i & 255) == 0 && result_container_is_cancelled(rs)) return;
+        score_item(p, rs, candidates[i]);
+    }
+}
+
+static void corpus_match(uint32_t id, const char* path, int32_t score, void* user_data) {
+    (void)path;
+    result_container_add_lazy_unique((ResultContainer*)user_data, score, (MatchFactory)bench_match_factory,
+                                     (void*)(uintptr_t)id, NULL);
+}
+
+void bob_launcher_search_base_search_shard(BobLauncherSearchBase* self, ResultContainer* rs, guint shard_id) {
+    BenchProvider* p = (BenchProvider*)self;
+    int from = (int64_t)p->n_items * shard_id / p->shard_count;
+    int to = (int64_t)p->n_items * (shard_id + 1) / p->shard_count;
+
+    if (p->corpus) {
+        path_corpus_search(p->corpus, rs, from, to, corpus_match, rs);
+        return;
+    }
+
+    uint32_t* candidates;
+    int n_candidates;
+    if (signature_index_lookup(p->index, rs, from, to, &candidates, &n_candidates)) {
+        score_candidates(p, rs, candidates, n_candidates);
+        free(candidates);
+        return;
+    }
+
+    for (int i = from; i < to; i++) {
+        if ((i & 255) == 0 && result_container_is_cancelled(rs)) return;
+        score_item(p, rs, i);
+    }
+}
+
+void bob_launcher_search_base_search_candidates(BobLauncherSearchBase* self, ResultContainer* rs,
+                                                guint32* candidates, gint candidates_length1) {
+    score_candidates((BenchProvider*)self, rs, candidates, candidates_length1);
+}
+
+// === Corpus ===
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+
+static uint32_t next_random(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return (uint32_t)rng_state;
+}
+
+static BenchProvider* provider_new(int n_items, int shard_count) {
+    BenchProvider* p = calloc(1, sizeof(BenchProvider));
+    p->regex = g_regex_new("", 0, 0, NULL);
+    p->shard_count = shard_count;
+    p->refine = opt_refine && !opt_corpus;
+    p->n_items = n_items;
+    p->items = malloc(n_items * sizeof(char*));
+    p->signatures = malloc(n_items * sizeof(uint64_t));
+
+    char buf[256];
+    for (int i = 0; i < n_items; i++) {
+        int depth = 2 + next_random() % 4;
+        int len = 0;
+        for (int d = 0; d < depth; d++)
+            len += snprintf(buf + len, sizeof(buf) - len, "/%s", words[next_random() % N_WORDS]);
+        snprintf(buf + len, sizeof(buf) - len, "%u.%s", next_random() % 1000,
+                 extensions[next_random() % N_EXTENSIONS]);
+        p->items[i] = strdup(buf);
+        p->signatures[i] = match_signature(buf);
+    }
+
+    if (opt_corpus) {
+        p->corpus = path_corpus_new();
+        for (int i = 0; i < n_items; i++) path_corpus_add(p->corpus, p->items[i], i);
+        path_corpus_build(p->corpus);
+    } else if (opt_index) {
+        p->index = signature_index_new();
+        for (int i = 0; i < n_items; i++) signature_index_add(p->index, p->items[i]);
+    }
+    return p;
+}
+
+// === Measurement ===
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static double keystroke(const char* query) {
+    int event_id = events_increment();
+    double start = now_ms();
+
+    data_sink_sources_execute_search(query, NULL, event_id, true);
+    while (published_event != event_id)
+        g_main_context_iteration(NULL, TRUE);
+
+    return now_ms() - start;
+}
+
+static int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(double* samples, int n, double p) {
+    if (n == 0) return 0.0;
+    int idx = (int)(p * (n - 1) + 0.5);
+    return samples[idx];
+}
+
+static int run(int threads) {
+    thread_pool_init(threads);
+    hashset_init(threads);
+    data_sink_sources_set_publish_interval(opt_publish);
+
+    state_providers = calloc(SEARCHING_FOR_COUNT, sizeof(HashSet*));
+    state_selected_indices = calloc(SEARCHING_FOR_COUNT, sizeof(int));
+    state_providers[SEARCHING_FOR_SOURCES] = hashset_create(events_get());
+
+    plugin_loader_default_search_providers = g_ptr_array_new();
+    for (int i = 0; i < opt_providers; i++)
+        g_ptr_array_add(plugin_loader_default_search_providers, provider_new(opt_items, opt_shards));
+
+    int capacity = 0;
+    for (size_t q = 0; q < N_QUERIES; q++)
+        capacity += strlen(queries[q]);
+    capacity *= opt_rounds;
+
+    double* typed = malloc(capacity * sizeof(double));
+    double* erased = malloc(capacity * sizeof(double));
+    int n_typed = 0, n_erased = 0;
+
+    char prefix[64];
+    for (int round = 0; round < opt_rounds; round++) {
+        for (size_t q = 0; q < N_QUERIES; q++) {
+            // every round starts cold, as if the launcher had just been opened
+            hashset_cache_clear();
+
+            size_t len = strlen(queries[q]);
+            for (size_t i = 1; i <= len; i++) {
+                memcpy(prefix, queries[q], i);
+                prefix[i] = '\0';
+                typed[n_typed++] = keystroke(prefix);
+            }
+            for (size_t i = len - 1; i >= 1; i--) {
+                prefix[i] = '\0';
+                erased[n_erased++] = keystroke(prefix);
+            }
+        }
+    }
+
+    qsort(typed, n_typed, sizeof(double), compare_double);
+    qsort(erased, n_erased, sizeof(double), compare_double);
+
+    printf("%7d %9d %6d %9d %10.3f %10.3f %10.3f %10.3f\n",
+           threads, opt_items, opt_shards, opt_providers,
+           percentile(typed, n_typed, 0.50), percentile(typed, n_typed, 0.99),
+           percentile(erased, n_erased, 0.50), percentile(erased, n_erased, 0.99));
+    fflush(stdout);
+    return 0;
+}
+
+static void usage(FILE* out, const char* name) {
+    fprintf(out,
+            "usage: %s [--items N] [--shards N] [--providers N] [--rounds N] [--threads 1,2,4] [--refine] [--corpus] [--index]\n"
+            "       [--publish MS] [--help]\n",
+            name);
+}
+
+static bool parse_args(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (strcmp(arg, "--refine") == 0) {
+            opt_refine = true;
+            continue;
+        }
+        if (strcmp(arg, "--corpus") == 0) {
+            opt_corpus = true;
+            continue;
+        }
+        if (strcmp(arg, "--index") == 0) {
+            opt_index = true;
+            continue;
+        }
+        if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) {
+            opt_help = true;
+            return true;
+        }
+        if (!value) return false;
+        i++;
+
+        if (strcmp(arg, "--items") == 0) {
+            opt_items = atoi(value);
+        } else if (strcmp(arg, "--shards") == 0) {
+            opt_shards = atoi(value);
+        } else if (strcmp(arg, "--providers") == 0) {
+            opt_providers = atoi(value);
+        } else if (strcmp(arg, "--publish") == 0) {
+            opt_publish = atoi(value);
+        } else if (strcmp(arg, "--rounds") == 0) {
+            opt_rounds = atoi(value);
+        } else if (strcmp(arg, "--threads") == 0) {
+            char* list = strdup(value);
+            for (char* tok = strtok(list, ","); tok && opt_thread_counts < MAX_THREAD_COUNTS; tok = strtok(NULL, ","))
+                opt_threads[opt_thread_counts++] = atoi(tok);
+            free(list);
+        } else {
+            return false;
+        }
+    }
+    return opt_items > 0 && opt_shards > 0 && opt_providers > 0 && opt_rounds > 0;
+}
+
+int main(int argc, char** argv) {
+    if (!parse_args(argc, argv)) {
+        usage(stderr, argv[0]);
+        return 2;
+    }
+    if (opt_help) {
+        usage(stdout, argv[0]);
+        return 0;
+    }
+
+    if (opt_thread_counts == 0) {
+        int cores = thread_pool_num_cores();
+        for (int n = 1; n < cores && opt_thread_counts < MAX_THREAD_COUNTS - 1; n *= 2)
+            opt_threads[opt_thread_counts++] = n;
+        opt_threads[opt_thread_counts++] = cores;
+    }
+
+    printf("# latency per keystroke in ms%s%s%s\n", opt_refine && !opt_corpus ? ", refinement enabled" : "",
+           opt_corpus ? ", sorted path corpus" : opt_index ? ", signature index" : "",
+           opt_publish ? ", until the first results are shown" : "");
+    printf("%7s %9s %6s %9s %10s %10s %10s %10s\n",
+           "threads", "items", "shards", "providers", "type p50", "type p99", "erase p50", "erase p99");
+    fflush(stdout);
+
+    int status = 0;
+    for (int i = 0; i < opt_thread_counts; i++) {
+        pid_t pid = fork();
+        if (pid < 0) return 1;
+        if (pid == 0) _exit(run(opt_threads[i]));
+
+        int child;
+        waitpid(pid, &child, 0);
+        if (!WIFEXITED(child) || WEXITSTATUS(child) != 0) status = 1;
+    }
+    return status;
+}
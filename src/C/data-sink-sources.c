@@ -11,6 +11,7 @@
 #include <time.h>
 #include <stdio.h>
 #include <time.h>
+#include <immintrin.h>
 
 typedef int BobLauncherSearchingFor;
 
@@ -24,9 +25,13 @@ extern char* bob_launcher_match_get_title(BobLauncherMatch* match);
 
 #define SEARCHING_FOR_SOURCES 1
 
+// A search that finds fewer results than this is repeated with the typo tier
+#define TYPO_MIN_RESULTS 8
+
 typedef struct {
     atomic_int workers;
     HashSet* set;
+    bool typos;
 } SearchContext;
 
 typedef struct {
@@ -41,6 +46,41 @@ typedef struct {
     atomic_int refs;
 } SharedNeedle;
 
+// The candidates a refinable provider reported during its last complete search.
+// A later query that extends `query` only needs to re-score these, and where
+// a DP row was kept for `needle_len` characters only the new rows. The slot
+// and every search refining from the set hold a reference.
+typedef struct {
+    atomic_int refs;
+    int event_id;
+    char* query;
+    int generation;
+    int needle_len;
+    int16_t* rows;
+    uint32_t* offsets;
+    int count;
+    uint32_t ids[];
+} CandidateSet;
+
+typedef struct {
+    BobLauncherSearchBase* sp;
+    CandidateSet* set;
+    atomic_int lock;
+} CandidateSlot;
+
+typedef struct {
+    uint32_t* ids;
+    int count;
+    bool lost;
+    CandidateRows rows;
+} ShardCandidates;
+
+#define MAX_REFINABLE_PROVIDERS 64
+
+static CandidateSlot candidate_slots[MAX_REFINABLE_PROVIDERS];
+static uintptr_t provider_signature = 0;
+static atomic_int candidate_epoch = 0;
+
 typedef struct {
     SharedNeedle* shared_needle;
     SearchContext* ctx;
@@ -48,26 +88,82 @@ typedef struct {
     BobLauncherSearchBase* plugin;
     int16_t bonus;
     atomic_int refs;
+
+    int event_id;
+    int shard_count;
+    int generation;
+    int epoch;
+    CandidateSlot* slot;
+    CandidateSet* previous;
+    ShardCandidates* shards;
 } PluginData;
 
 typedef struct {
     BobLauncherSearchBase* sp;
     size_t shard_count;
-    SharedNeedle* needle;
+    int end_pos;
 } SearchPlugin;
 
+// The search whose merged set goes into the result cache once it is shown
+static int pending_event_id = -1;
+static CacheProvider* pending_providers = NULL;
+static int pending_provider_count = 0;
+static char* pending_query = NULL;
+
+// The last search started, for repeating it with the typo tier
+static char* last_query = NULL;
+static BobLauncherSearchBase* last_selected = NULL;
+static int last_event_id = -1;
+static int typo_event_id = -1;
+
+// Milliseconds between publishing what a running search has found so far, 0 waits for the whole search
+static int publish_interval = 0;
+
+static void execute_search(const char* query, BobLauncherSearchBase* selected_plg, int event_id, bool typos);
+
+static void maybe_search_typos(HashSet* set) {
+    if (set->event_id != last_event_id || typo_event_id == last_event_id) return;
+    if (atomic_load(&set->size) >= TYPO_MIN_RESULTS || !events_ok(last_event_id)) return;
+    if (g_utf8_strlen(last_query, -1) < MATCH_TYPO_MIN_NEEDLE) return;
+
+    // the exact set is what gets cached, a cache hit repeats this pass
+    typo_event_id = last_event_id;
+    pending_event_id = -1;
+    execute_search(last_query, last_selected, last_event_id, true);
+}
+
+// A snapshot is stale once its search has merged, or behind one already shown
+static bool snapshot_outdated(HashSet* set) {
+    if (hashset_merged(set->source)) return true;
+    HashSet* shown = state_providers[SEARCHING_FOR_SOURCES];
+    return shown->source == set->source && atomic_load(&shown->hash_size) > atomic_load(&set->hash_size);
+}
+
 static bool update_ui_callback(void* data) {
     HashSet* set = (HashSet*)data;
-    int size = size = atomic_load_explicit(&set->size, memory_order_acquire);
+    // the next tick may take a snapshot again
+    if (set->source) atomic_store(&set->source->publishing, 0);
+    if (set->source && snapshot_outdated(set)) {
+        thread_pool_run((TaskFunc)hashset_destroy, set, NULL);
+        return false;
+    }
 
-    bool reset_index = true;
+    int size = atomic_load_explicit(&set->size, memory_order_acquire);
 
-    int old = state_providers[SEARCHING_FOR_SOURCES]->size;
-    int new_index = (reset_index && old != size) ? 0 :
+    // snapshots and the merged set of one search keep the selection, a new query starts over
+    HashSet* shown = state_providers[SEARCHING_FOR_SOURCES];
+    bool reset_index = shown->event_id != set->event_id;
+
+    int new_index = (reset_index && shown->size != size) ? 0 :
                     state_selected_indices[SEARCHING_FOR_SOURCES];
 
+    bool partial = set->source != NULL;
+    bool cache = !partial && set->event_id == pending_event_id;
+
     if (state_update_provider(SEARCHING_FOR_SOURCES, set, new_index)) {
+        if (cache) hashset_cache_insert(SEARCHING_FOR_SOURCES, pending_providers, pending_provider_count, pending_query, set);
         state_update_layout(SEARCHING_FOR_SOURCES);
+        if (!partial) maybe_search_typos(set);
     }
 
     return false;
@@ -80,7 +176,35 @@ static inline void merge_hashset_parallel_wrapper(void* user_data) {
     }
 }
 
-static SharedNeedle* create_shared_needle(const char* query) {
+static void publish_snapshot(void* data) {
+    HashSet* set = (HashSet*)data;
+    HashSet* snapshot = hashset_snapshot(set);
+    if (snapshot) {
+        g_main_context_invoke_full(NULL, G_PRIORITY_HIGH, (GSourceFunc)update_ui_callback, snapshot, NULL);
+    } else {
+        atomic_store(&set->publishing, 0);
+    }
+}
+
+// Every snapshot copies and sorts all rows flushed so far, so no new one is
+// taken while the last is still on its way to the UI
+static gboolean publish_tick(void* data) {
+    HashSet* set = (HashSet*)data;
+    if (!events_ok(set->event_id) || hashset_merged(set)) return G_SOURCE_REMOVE;
+    if (atomic_exchange(&set->publishing, 1)) return G_SOURCE_CONTINUE;
+
+    thread_pool_run(publish_snapshot, hashset_ref(set), (TaskFunc)hashset_destroy);
+    return G_SOURCE_CONTINUE;
+}
+
+// The shards of the slowest provider no longer hold back what the others found
+static void schedule_publishing(HashSet* set) {
+    if (publish_interval > 0)
+        g_timeout_add_full(G_PRIORITY_HIGH, publish_interval, publish_tick, hashset_ref(set),
+                           (GDestroyNotify)hashset_destroy);
+}
+
+static SharedNeedle* create_shared_needle(const char* query, bool typos) {
     SharedNeedle* sn = malloc(sizeof(SharedNeedle));
     sn->query = strdup(query);
     sn->needle = prepare_needle(query);
@@ -89,6 +213,11 @@ static SharedNeedle* create_shared_needle(const char* query) {
     sn->needle_spaceless = prepare_needle(query_spaceless);
     free(query_spaceless);
 
+    if (typos) {
+        needle_enable_typos(sn->needle);
+        needle_enable_typos(sn->needle_spaceless);
+    }
+
     atomic_init(&sn->refs, 0);
     return sn;
 }
@@ -102,6 +231,145 @@ static void shared_needle_unref(SharedNeedle* sn) {
     }
 }
 
+static inline void spin_lock(atomic_int* lock) {
+    while (atomic_exchange(lock, 1)) {
+        _mm_pause();
+    }
+}
+
+static inline void spin_unlock(atomic_int* lock) {
+    atomic_store(lock, 0);
+}
+
+static void candidate_set_unref(CandidateSet* set) {
+    if (!set || atomic_fetch_sub(&set->refs, 1) != 1) return;
+    free(set->query);
+    free(set->rows);
+    free(set->offsets);
+    free(set);
+}
+
+static CandidateSlot* candidate_slot(BobLauncherSearchBase* sp) {
+    CandidateSlot* empty = NULL;
+    for (int i = 0; i < MAX_REFINABLE_PROVIDERS; i++) {
+        if (candidate_slots[i].sp == sp) return &candidate_slots[i];
+        if (!empty && !candidate_slots[i].sp) empty = &candidate_slots[i];
+    }
+    if (empty) empty->sp = sp;
+    return empty;
+}
+
+// Returns the list that lost its place. The epoch is checked under the lock,
+// so nothing lands in a slot after drop_all_candidates() emptied it.
+static CandidateSet* replace_candidates(CandidateSlot* slot, CandidateSet* next, int epoch) {
+    spin_lock(&slot->lock);
+    CandidateSet* old = slot->set;
+    // a search that started earlier may finish later, it must not undo a newer list
+    if (epoch != atomic_load(&candidate_epoch) || (next && old && old->event_id > next->event_id)) {
+        old = next;
+    } else {
+        slot->set = next;
+    }
+    spin_unlock(&slot->lock);
+    return old;
+}
+
+// Slots keep their provider, a search still in flight may hold a pointer to one.
+// Bumping the epoch stops those searches from publishing into the emptied slots.
+static void drop_all_candidates(void) {
+    const int epoch = atomic_fetch_add(&candidate_epoch, 1) + 1;
+    for (int i = 0; i < MAX_REFINABLE_PROVIDERS; i++)
+        candidate_set_unref(replace_candidates(&candidate_slots[i], NULL, epoch));
+}
+
+// Only a strictly longer query can be refined, everything else (backspace,
+// edits in the middle, periodic refreshes) needs the whole corpus again. The
+// list stays published, so keystrokes arriving while a refinement runs start
+// from it as well.
+static CandidateSet* take_candidates(CandidateSlot* slot, const char* query, int generation) {
+    spin_lock(&slot->lock);
+    CandidateSet* set = slot->set;
+    if (set) {
+        size_t len = strlen(set->query);
+        if (set->generation == generation && strlen(query) > len && strncmp(query, set->query, len) == 0)
+            atomic_fetch_add(&set->refs, 1);
+        else
+            set = NULL;
+    }
+    spin_unlock(&slot->lock);
+    return set;
+}
+
+// Rows are optional, a set without them is refined with full DP per candidate
+static void collect_rows(PluginData* pd, CandidateSet* set) {
+    size_t total = 0;
+    for (int i = 0; i < pd->shard_count; i++)
+        total += pd->shards[i].rows.size;
+
+    set->rows = total ? malloc(total * sizeof(int16_t)) : NULL;
+    set->offsets = set->rows ? malloc(set->count * sizeof(uint32_t)) : NULL;
+    if (!set->offsets) {
+        free(set->rows);
+        set->rows = NULL;
+        return;
+    }
+
+    size_t base = 0;
+    int index = 0;
+    for (int i = 0; i < pd->shard_count; i++) {
+        const ShardCandidates* shard = &pd->shards[i];
+        if (!shard->count) continue;
+        memcpy(set->rows + base, shard->rows.data, shard->rows.size * sizeof(int16_t));
+        for (int k = 0; k < shard->count; k++) {
+            uint32_t offset = shard->rows.offsets[k];
+            set->offsets[index++] = offset == CANDIDATE_NO_ROW ? offset : offset + base;
+        }
+        base += shard->rows.size;
+    }
+}
+
+static CandidateSet* collect_candidates(PluginData* pd) {
+    int total = 0;
+    for (int i = 0; i < pd->shard_count; i++) {
+        if (pd->shards[i].lost) return NULL;
+        total += pd->shards[i].count;
+    }
+
+    CandidateSet* set = malloc(sizeof(CandidateSet) + total * sizeof(uint32_t));
+    if (!set) return NULL;
+
+    atomic_init(&set->refs, 1);
+    set->event_id = pd->event_id;
+    set->query = strdup(pd->shared_needle->query);
+    set->generation = pd->generation;
+    set->needle_len = pd->shared_needle->needle->len;
+    set->count = 0;
+    for (int i = 0; i < pd->shard_count; i++) {
+        if (!pd->shards[i].count) continue;
+        memcpy(set->ids + set->count, pd->shards[i].ids, pd->shards[i].count * sizeof(uint32_t));
+        set->count += pd->shards[i].count;
+    }
+    collect_rows(pd, set);
+    return set;
+}
+
+static void publish_candidates(PluginData* pd) {
+    // events only ever move forward, so if ours is still current no shard was cancelled.
+    // A refinement that did not finish leaves the list it started from published.
+    if (pd->epoch == atomic_load(&candidate_epoch) && events_ok(pd->event_id)) {
+        CandidateSet* next = collect_candidates(pd);
+        if (next) candidate_set_unref(replace_candidates(pd->slot, next, pd->epoch));
+    }
+    candidate_set_unref(pd->previous);
+
+    for (int i = 0; i < pd->shard_count; i++) {
+        free(pd->shards[i].ids);
+        free(pd->shards[i].rows.data);
+        free(pd->shards[i].rows.offsets);
+    }
+    free(pd->shards);
+}
+
 static void search_func(void* user_data) {
     int* my_id_ptr = (int*)user_data;
     int shard = *my_id_ptr;
@@ -115,10 +383,31 @@ static void search_func(void* user_data) {
     SharedNeedle* sn = plugin_data->shared_needle;
     ResultContainer* rc = hashset_create_handle(set, sn->query, plugin_data->bonus,
                                                  sn->needle, sn->needle_spaceless);
-    bob_launcher_search_base_search_shard(plugin_data->plugin, rc, shard);
+    rc->record_candidates = plugin_data->slot != NULL;
+
+    CandidateSet* previous = plugin_data->previous;
+    if (previous) {
+        int from = (int64_t)previous->count * shard / plugin_data->shard_count;
+        int to = (int64_t)previous->count * (shard + 1) / plugin_data->shard_count;
+        rc->previous_ids = previous->ids + from;
+        rc->previous_offsets = previous->offsets ? previous->offsets + from : NULL;
+        rc->previous_rows = previous->rows;
+        rc->previous_count = to - from;
+        rc->previous_needle_len = previous->needle_len;
+        if (to > from)
+            bob_launcher_search_base_search_candidates(plugin_data->plugin, rc, previous->ids + from, to - from);
+    } else {
+        bob_launcher_search_base_search_shard(plugin_data->plugin, rc, shard);
+    }
 
     container_flush_items(rc);
     container_return_sheet(set, rc);
+
+    if (plugin_data->slot) {
+        plugin_data->shards[shard] = (ShardCandidates){rc->candidates, rc->candidates_size, rc->candidates_lost, rc->rows};
+        rc->candidates = NULL;
+        rc->rows = (CandidateRows){0};
+    }
     container_destroy(rc);
 }
 
@@ -126,7 +415,9 @@ static void finalize_search(SearchContext* ctx) {
     if (atomic_fetch_sub(&ctx->workers, 1) != 1) return;
 
     if (events_ok(ctx->set->event_id)) {
-        for (int i = 0; i < ctx->set->merge_workers; i++) {
+        hashset_seal(ctx->set);
+        const int workers = hashset_plan_merge(ctx->set);
+        for (int i = 0; i < workers; i++) {
             MergeTask* task = malloc(sizeof(MergeTask));
             task->set = ctx->set;
             task->merge_id = i;
@@ -144,14 +435,16 @@ static void plugin_data_unref(void* user_data) {
     int shard = *my_id_ptr;
 
     PluginData* pd = (PluginData*)((char*)my_id_ptr - shard * sizeof(int) - sizeof(PluginData));
+    SharedNeedle* sn = pd->shared_needle;
 
     finalize_search(pd->ctx);
 
-    shared_needle_unref(pd->shared_needle);
-
     if (atomic_fetch_sub(&pd->refs, 1) == 1) {
+        if (pd->slot) publish_candidates(pd);
         free(pd);
     }
+
+    shared_needle_unref(sn);
 }
 
 static void search_plugin(BobLauncherSearchBase* sp, SearchContext* ctx, SharedNeedle* needle, size_t shard_count) {
@@ -164,6 +457,26 @@ static void search_plugin(BobLauncherSearchBase* sp, SearchContext* ctx, SharedN
     plugin_data->bonus = bob_launcher_plugin_base_get_bonus((BobLauncherPluginBase*)sp);
     atomic_init(&plugin_data->refs, shard_count);
 
+    plugin_data->event_id = ctx->set->event_id;
+    plugin_data->shard_count = shard_count;
+    plugin_data->slot = NULL;
+    plugin_data->previous = NULL;
+    plugin_data->shards = NULL;
+
+    // typo matches are no subset of what the next keystroke matches exactly
+    if (!ctx->typos && bob_launcher_search_base_get_supports_refinement(sp)) {
+        plugin_data->shards = calloc(shard_count, sizeof(ShardCandidates));
+        plugin_data->slot = plugin_data->shards ? candidate_slot(sp) : NULL;
+        if (plugin_data->slot) {
+            plugin_data->generation = bob_launcher_search_base_get_candidate_generation(sp);
+            plugin_data->epoch = atomic_load(&candidate_epoch);
+            plugin_data->previous = take_candidates(plugin_data->slot, needle->query, plugin_data->generation);
+        } else {
+            free(plugin_data->shards);
+            plugin_data->shards = NULL;
+        }
+    }
+
     int* worker_ids = (int*)(plugin_data + 1);
 
     for (size_t i = 0; i < shard_count; i++) {
@@ -172,15 +485,56 @@ static void search_plugin(BobLauncherSearchBase* sp, SearchContext* ctx, SharedN
     }
 }
 
-void data_sink_sources_execute_search(const char* query,
-                                      BobLauncherSearchBase* selected_plg,
-                                      const int event_id,
-                                      const bool reset_index) {
-    SearchContext* ctx = aligned_alloc(64, sizeof(SearchContext));
-    if (ctx == NULL) return;
-    ctx->set = hashset_create(event_id);
+// A change in which providers take part forces a full search everywhere
+static void check_provider_signature(uintptr_t signature) {
+    if (signature != provider_signature) {
+        drop_all_candidates();
+        provider_signature = signature;
+    }
+}
 
+// The candidate generation goes up whenever a provider reports a changed
+// corpus, which also keeps the sets cached before out of later searches
+static CacheProvider cache_provider(BobLauncherSearchBase* sp) {
+    return (CacheProvider){sp, bob_launcher_search_base_get_candidate_generation(sp)};
+}
+
+static bool publish_cached(const char* query, const CacheProvider* providers, int count, int event_id) {
+    HashSet* cached = hashset_cache_lookup(SEARCHING_FOR_SOURCES, providers, count, query);
+    if (!cached) {
+        free(pending_providers);
+        free(pending_query);
+        pending_providers = malloc(MAX(count, 1) * sizeof(CacheProvider));
+        pending_query = strdup(query);
+        if (!pending_providers || !pending_query) {
+            pending_event_id = -1;
+            return false;
+        }
+        memcpy(pending_providers, providers, count * sizeof(CacheProvider));
+        pending_provider_count = count;
+        pending_event_id = event_id;
+        return false;
+    }
+
+    cached->event_id = event_id;
+    update_ui_callback(cached);
+    return true;
+}
+
+static void execute_search(const char* query, BobLauncherSearchBase* selected_plg, int event_id, bool typos) {
     if (selected_plg) {
+        // periodically refreshed providers must always hit their data again
+        bool cacheable = !typos && bob_launcher_search_base_get_update_interval(selected_plg) <= 0;
+        const CacheProvider provider = cache_provider(selected_plg);
+        check_provider_signature((uintptr_t)selected_plg);
+        if (cacheable && publish_cached(query, &provider, 1, event_id)) return;
+        if (!cacheable) pending_event_id = -1;
+
+        SearchContext* ctx = aligned_alloc(64, sizeof(SearchContext));
+        if (ctx == NULL) return;
+        ctx->set = hashset_create(event_id);
+        ctx->typos = typos;
+
         GRegex* regex = bob_launcher_search_base_get_compiled_regex(selected_plg);
         int end_pos = 0;
         if (g_regex_get_capture_count(regex) > 0) {
@@ -195,17 +549,18 @@ void data_sink_sources_execute_search(const char* query,
         ctx->set->merge_workers = MIN(shard_count, hashset_merge_threads);
         atomic_init(&ctx->workers, shard_count);
 
-        SharedNeedle* needle = create_shared_needle(query + end_pos);
+        SharedNeedle* needle = create_shared_needle(query + end_pos, typos);
         atomic_fetch_add(&needle->refs, shard_count);
 
+        schedule_publishing(ctx->set);
         search_plugin(selected_plg, ctx, needle, shard_count);
     } else {
         SearchPlugin plugins[plugin_loader_default_search_providers->len];
         int counter = 0;
         int total_shards = 0;
-
-        int query_len = strlen(query);
-        SharedNeedle** needles_by_offset = calloc(query_len + 1, sizeof(SharedNeedle*));
+        uintptr_t signature = 0;
+        CacheProvider providers[plugin_loader_default_search_providers->len];
+        bool cacheable = !typos;
 
         for (size_t i = 0; i < plugin_loader_default_search_providers->len; i++) {
             BobLauncherSearchBase* sp = plugin_loader_default_search_providers->pdata[i];
@@ -221,26 +576,61 @@ void data_sink_sources_execute_search(const char* query,
                 }
 
                 size_t shard_count = bob_launcher_search_base_get_shard_count(sp);
+                total_shards += shard_count;
 
-                if (!needles_by_offset[end_pos])
-                    needles_by_offset[end_pos] = create_shared_needle(query + end_pos);
+                providers[counter] = cache_provider(sp);
+                plugins[counter++] = (SearchPlugin){sp, shard_count, end_pos};
+                signature = signature * 31 + (uintptr_t)sp;
+                // periodically refreshed providers must always hit their data again
+                if (bob_launcher_search_base_get_update_interval(sp) > 0) cacheable = false;
+            }
+            g_match_info_free(match_info);
+        }
 
-                atomic_fetch_add(&needles_by_offset[end_pos]->refs, shard_count);
+        check_provider_signature(signature);
+        if (cacheable && publish_cached(query, providers, counter, event_id)) return;
+        if (!cacheable) pending_event_id = -1;
 
-                total_shards += shard_count;
+        SearchContext* ctx = aligned_alloc(64, sizeof(SearchContext));
+        if (ctx == NULL) return;
+        ctx->set = hashset_create(event_id);
+        ctx->typos = typos;
 
-                plugins[counter++] = (SearchPlugin){sp, shard_count, needles_by_offset[end_pos]};
-                g_match_info_free(match_info);
-            }
+        int query_len = strlen(query);
+        SharedNeedle** needles_by_offset = calloc(query_len + 1, sizeof(SharedNeedle*));
+
+        for (int i = 0; i < counter; i++) {
+            int end_pos = plugins[i].end_pos;
+            if (!needles_by_offset[end_pos])
+                needles_by_offset[end_pos] = create_shared_needle(query + end_pos, typos);
+
+            atomic_fetch_add(&needles_by_offset[end_pos]->refs, plugins[i].shard_count);
         }
 
         atomic_init(&ctx->workers, total_shards);
         ctx->set->merge_workers = MIN(total_shards, hashset_merge_threads);
-        for (size_t i = 0; i < counter; i++) {
+        schedule_publishing(ctx->set);
+        for (int i = 0; i < counter; i++) {
             SearchPlugin plg = plugins[i];
-            search_plugin(plg.sp, ctx, plg.needle, plg.shard_count);
+            search_plugin(plg.sp, ctx, needles_by_offset[plg.end_pos], plg.shard_count);
         }
 
         free(needles_by_offset);
     }
 }
+
+void data_sink_sources_set_publish_interval(int interval) {
+    publish_interval = interval < 0 ? 0 : interval;
+}
+
+void data_sink_sources_execute_search(const char* query,
+                                      BobLauncherSearchBase* selected_plg,
+                                      const int event_id,
+                                      const bool reset_index) {
+    free(last_query);
+    last_query = strdup(query);
+    last_selected = selected_plg;
+    last_event_id = event_id;
+
+    execute_search(query, selected_plg, event_id, false);
+}
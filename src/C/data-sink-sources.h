@@ -10,3 +10,6 @@ void data_sink_sources_execute_search(
     BobLauncherSearchBase* selected_plg,
     const int event_id,
     const bool reset_index);
+
+// Milliseconds after which a running search shows what it has so far, 0 disables that
+void data_sink_sources_set_publish_interval(int interval);
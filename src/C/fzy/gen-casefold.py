@@ -0,0 +1,140 @@
+#!/usr/bin/env python3
+"""Generate the case tables used by fzy/match.c.
+
+Usage: gen-casefold.py OUTPUT [CaseFolding.txt]
+
+Simple case folding comes from CaseFolding.txt (statuses C and S) when one
+is given, otherwise from the Unicode database bundled with Python. Every
+codepoint that folds, or is folded to, belongs to a class named by its fold.
+Three per-codepoint deltas are emitted:
+
+  fold       the class fold, used for the case-insensitive signatures
+  canonical  the fold for lowercase members, the class's uppercase member
+             for the others; haystack and needle characters are compared
+             in this form, so an uppercase needle character still only
+             matches uppercase text
+  partner    for a class fold, the uppercase member it also matches
+
+Each table is split into 64-entry blocks; identical blocks are stored once
+and shared between the tables, and a per-table byte index picks the block.
+"""
+
+import sys
+import unicodedata
+
+BLOCK_SHIFT = 6
+BLOCK = 1 << BLOCK_SHIFT
+MAX_CODEPOINT = 0x110000
+
+
+def read_case_folding(path):
+    fold = {}
+    with open(path, encoding="utf-8") as f:
+        for line in f:
+            line = line.split("#", 1)[0].strip()
+            if not line:
+                continue
+            code, status, mapping = [field.strip() for field in line.split(";")[:3]]
+            if status in ("C", "S"):
+                fold[int(code, 16)] = int(mapping, 16)
+    return fold
+
+
+def derive_case_folding():
+    fold = {}
+    for cp in range(MAX_CODEPOINT):
+        if 0xD800 <= cp < 0xE000:
+            continue
+        c = chr(cp)
+        folded = c.casefold()
+        # a full folding longer than one character has a simple one in lower()
+        if len(folded) != 1:
+            folded = c.lower()
+        if len(folded) == 1 and folded != c:
+            fold[cp] = ord(folded)
+    return fold
+
+
+def build_tables(fold):
+    classes = {}
+    for cp, target in fold.items():
+        classes.setdefault(target, {target}).add(cp)
+
+    fold_delta, canonical_delta, partner_delta = {}, {}, {}
+    for target, members in classes.items():
+        upper = chr(target).upper()
+        if len(upper) == 1 and ord(upper) in members and ord(upper) != target:
+            partner = ord(upper)
+        else:
+            others = sorted(m for m in members if m != target and not chr(m).islower())
+            partner = others[0] if others else target
+
+        if partner != target:
+            partner_delta[target] = partner - target
+        for cp in members:
+            if cp != target:
+                fold_delta[cp] = target - cp
+            canonical = target if chr(cp).islower() or cp == target else partner
+            if canonical != cp:
+                canonical_delta[cp] = canonical - cp
+
+    return fold_delta, canonical_delta, partner_delta
+
+
+def main():
+    if len(sys.argv) not in (2, 3):
+        sys.exit(__doc__.strip().splitlines()[2])
+
+    source = sys.argv[2] if len(sys.argv) == 3 else None
+    fold = read_case_folding(source) if source else derive_case_folding()
+    tables = dict(zip(("fold", "canonical", "partner"), build_tables(fold)))
+
+    limit = max(max(t) for t in tables.values()) + 1
+    limit = (limit + BLOCK - 1) // BLOCK * BLOCK
+
+    blocks = [tuple([0] * BLOCK)]
+    block_ids = {blocks[0]: 0}
+    indexes = {}
+    for name, deltas in tables.items():
+        index = []
+        for start in range(0, limit, BLOCK):
+            block = tuple(deltas.get(cp, 0) for cp in range(start, start + BLOCK))
+            if block not in block_ids:
+                block_ids[block] = len(blocks)
+                blocks.append(block)
+            index.append(block_ids[block])
+        indexes[name] = index
+
+    if len(blocks) > 256:
+        sys.exit("too many case table blocks for a byte index: %d" % len(blocks))
+
+    origin = source or "the Unicode %s database" % unicodedata.unidata_version
+    out = []
+    out.append("// Generated by gen-casefold.py from %s, do not edit." % origin)
+    out.append("#pragma once")
+    out.append("")
+    out.append("#include <stdint.h>")
+    out.append("")
+    out.append("#define CASEFOLD_BLOCK_SHIFT %d" % BLOCK_SHIFT)
+    out.append("#define CASEFOLD_LIMIT 0x%x" % limit)
+    out.append("")
+    out.append("static const int32_t casefold_blocks[%d][%d] = {" % (len(blocks), BLOCK))
+    for block in blocks:
+        out.append("\t{")
+        for row in range(0, BLOCK, 8):
+            out.append("\t\t" + ", ".join(str(d) for d in block[row:row + 8]) + ",")
+        out.append("\t},")
+    out.append("};")
+    for name, index in indexes.items():
+        out.append("")
+        out.append("static const uint8_t casefold_%s_index[%d] = {" % (name, len(index)))
+        for row in range(0, len(index), 16):
+            out.append("\t" + ", ".join(str(i) for i in index[row:row + 16]) + ",")
+        out.append("};")
+
+    with open(sys.argv[1], "w", encoding="utf-8") as f:
+        f.write("\n".join(out) + "\n")
+
+
+if __name__ == "__main__":
+    main()
@@ -5,10 +5,12 @@
 #include <math.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <pthread.h>
 
 #include "match.h"
 #include "bonus.h"
 #include "config.h"
+#include "casefold-table.h"
 
 static inline uint32_t utf8_to_codepoint(const char* str, int* advance) {
     const uint8_t* s = (const uint8_t*)str;
@@ -110,6 +112,26 @@ static inline uint32_t utf8_to_codepoint(const char* str, int* advance) {
     }
 }
 
+/*
+ * Simple case folding through the tables generated by gen-casefold.py:
+ * two lookups and an add, whatever the script. Codepoints past the tables
+ * read the all-zero delta block of codepoint 0.
+ */
+static inline uint32_t case_lookup(const uint8_t* index, uint32_t c) {
+	const uint32_t i = c < CASEFOLD_LIMIT ? c : 0;
+	return c + casefold_blocks[index[i >> CASEFOLD_BLOCK_SHIFT]][i & ((1 << CASEFOLD_BLOCK_SHIFT) - 1)];
+}
+
+#define casefold(c) case_lookup(casefold_fold_index, (c))
+#define casefold_canonical(c) case_lookup(casefold_canonical_index, (c))
+#define casefold_partner(c) case_lookup(casefold_partner_index, (c))
+
+// Haystacks are compared in canonical case; ASCII already is
+static inline uint32_t haystack_codepoint(const char* str, int* advance) {
+	const uint32_t c = utf8_to_codepoint(str, advance);
+	return c < 0x80 ? c : casefold_canonical(c);
+}
+
 int haystack_update(haystack_info* hay, const char* str, uint16_t common_chars,
                     haystack_index* index,
                     const needle_info* needle) {
@@ -123,7 +145,7 @@ int haystack_update(haystack_info* hay, const char* str, uint16_t common_chars,
 
     for (; pos < MATCH_MAX_LEN && *s; pos++) {
         int char_len;
-        uint32_t codepoint = utf8_to_codepoint((const char*)s, &char_len);
+        uint32_t codepoint = haystack_codepoint((const char*)s, &char_len);
 
         hay->chars[pos] = codepoint;
         hay->bonus[pos] = COMPUTE_BONUS(last_ch, (unsigned char)codepoint);
@@ -158,7 +180,7 @@ int setup_haystack_and_match(const needle_info* needle, haystack_info* hay, cons
 
 	while (*haystack_str && pos < MATCH_MAX_LEN) {
 		int char_len;
-		uint32_t curr = utf8_to_codepoint(haystack_str, &char_len);
+		uint32_t curr = haystack_codepoint(haystack_str, &char_len);
 		hay->chars[pos++] = curr;
 		haystack_str += char_len;
 
@@ -173,11 +195,269 @@ int setup_haystack_and_match(const needle_info* needle, haystack_info* hay, cons
 }
 
 
-int query_has_match(const needle_info* needle, const char* haystack) {
+/*
+ * ASCII fast path. When needle and haystack are both 7-bit, the haystack
+ * bytes already are the codepoints: the subsequence check and the DP read
+ * them in place, with a one-byte bonus per column, instead of decoding into
+ * the uint32 arrays of a haystack_info. UTF-8 decoding never produces an
+ * ASCII codepoint from a non-ASCII byte, so anything else takes the
+ * decoding path unchanged.
+ */
+typedef uint8_t ascii_vec __attribute__((vector_size(16)));
+
+/* Length of str capped at MATCH_MAX_LEN, or -1 if that span has a non-ASCII byte */
+static inline int ascii_length(const char* str) {
+	const size_t len = strnlen(str, MATCH_MAX_LEN);
+	size_t i = 0;
+
+	ascii_vec high = {0};
+	for (; i + sizeof(ascii_vec) <= len; i += sizeof(ascii_vec)) {
+		ascii_vec chunk;
+		memcpy(&chunk, str + i, sizeof(chunk));
+		high |= chunk;
+	}
+
+	uint8_t any = 0;
+	for (size_t k = 0; k < sizeof(ascii_vec); k++) any |= high[k];
+	for (; i < len; i++) any |= (uint8_t)str[i];
+
+	return (any & 0x80) ? -1 : (int)len;
+}
+
+static inline int ascii_has_match(const needle_info* needle, const uint8_t* hay, int m) {
+	const int n = needle->len;
+	int i = 0;
+	for (int j = 0; j < m && i < n; j++) {
+		if (hay[j] == needle->chars[i] || hay[j] == needle->unicode_upper[i]) i++;
+	}
+	return i == n;
+}
+
+/*
+ * Character-presence signature: one bit per case-folded letter, one per
+ * digit and 28 shared by everything else, hashed by simple case fold so
+ * every case variant a needle character accepts sets the same bit.
+ */
+static inline uint64_t signature_bit(uint32_t c) {
+	if (c >= 0x80) c = casefold(c);
+	if (c >= 0x80) return 1ULL << (36 + c % 28);
+	if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+	if (c >= 'a' && c <= 'z') return 1ULL << (c - 'a');
+	if (c >= '0' && c <= '9') return 1ULL << (26 + c - '0');
+	return 1ULL << (36 + c % 28);
+}
+
+uint64_t match_signature(const char* haystack) {
+	if (!haystack) return 0;
+
+	uint64_t signature = 0;
+	for (const char* s = haystack; *s;) {
+		if ((uint8_t)*s < 0x80) {
+			signature |= signature_bit((uint8_t)*s++);
+			continue;
+		}
+		int char_len;
+		signature |= signature_bit(utf8_to_codepoint(s, &char_len));
+		s += char_len;
+	}
+	return signature;
+}
+
+static int strict_has_match(const needle_info* needle, const char* haystack) {
+	if (needle->ascii && haystack && *haystack) {
+		int m = ascii_length(haystack);
+		if (m >= 0) return ascii_has_match(needle, (const uint8_t*)haystack, m);
+	}
+
 	haystack_info hay_info;
 	return setup_haystack_and_match(needle, &hay_info, haystack);
 }
 
+/*
+ * Typo tier: the smallest number of insertions, deletions, substitutions
+ * and adjacent transpositions that turn the needle into some substring of
+ * the haystack. Hyyrö's bit-vector formulation of the optimal string
+ * alignment distance, one needle character per bit, so needles are
+ * limited to 64 characters.
+ */
+static inline uint64_t typo_eq(const needle_info* needle, uint32_t c) {
+	if (needle->char_mask) return c < 0x80 ? needle->char_mask[c] : 0;
+
+	uint64_t eq = 0;
+	for (int i = 0; i < needle->len; i++) {
+		if (c == needle->chars[i] || c == needle->unicode_upper[i]) eq |= 1ULL << i;
+	}
+	return eq;
+}
+
+// The distance, or max + 1 once it is known to exceed max
+int match_typo_distance(const needle_info* needle, const char* haystack_str, int max) {
+	const int n = needle->len;
+	if (n == 0 || n > 64 || !haystack_str) return max + 1;
+
+	const uint64_t last = 1ULL << (n - 1);
+	uint64_t vp = ~0ULL, vn = 0, d0 = 0, prev_eq = 0;
+	int distance = n, best = n;
+
+	for (int j = 0; *haystack_str && j < MATCH_MAX_LEN; j++) {
+		int char_len;
+		const uint64_t eq = typo_eq(needle, haystack_codepoint(haystack_str, &char_len));
+		haystack_str += char_len;
+
+		const uint64_t transposed = ((~d0 & eq) << 1) & prev_eq;
+		d0 = (((eq & vp) + vp) ^ vp) | eq | vn | transposed;
+		const uint64_t hp = vn | ~(d0 | vp);
+		const uint64_t hn = vp & d0;
+
+		distance += (hp & last) ? 1 : (hn & last) ? -1 : 0;
+		if (distance < best) best = distance;
+
+		const uint64_t x = hp << 1;
+		vn = x & d0;
+		vp = (hn << 1) | ~(x | d0);
+		prev_eq = eq;
+	}
+	return best <= max ? best : max + 1;
+}
+
+/*
+ * A strict match that scores as low as the typo tier is lifted just above it,
+ * so every strict match outranks every typo match. Scores at or below
+ * SCORE_BELOW_THRESHOLD stay as they are, they mean no match.
+ */
+static inline score_t strict_score(score_t score) {
+	return score > SCORE_BELOW_THRESHOLD && score < SCORE_STRICT_MIN ? SCORE_STRICT_MIN : score;
+}
+
+static inline int typo_match(const needle_info* needle, const char* haystack, score_t* score) {
+	int distance = match_typo_distance(needle, haystack, needle->typo_max);
+	if (distance > needle->typo_max) return 0;
+	*score = SCORE_TYPO(distance);
+	return 1;
+}
+
+// Short needles are within two edits of far too much to be useful
+void needle_enable_typos(needle_info* needle) {
+	if (!needle) return;
+
+	if (needle->tokenized) {
+		for (int t = 0; t < needle->token_count; t++) {
+			needle_enable_typos(needle->tokens[t]);
+			needle->typo_max = MAX(needle->typo_max, needle->tokens[t]->typo_max);
+		}
+		if (needle->typo_max) needle->signature = 0;
+		return;
+	}
+
+	if (needle->len > 64) return;
+
+	needle->typo_max = needle->len >= 2 * MATCH_TYPO_MIN_NEEDLE ? 2 : needle->len >= MATCH_TYPO_MIN_NEEDLE ? 1 : 0;
+	if (needle->typo_max) needle->signature = 0;
+}
+
+/*
+ * Multi-token queries: every whitespace-separated token has to be a
+ * subsequence of the haystack on its own, in any order, and the token
+ * scores add up. Sums are kept above the typo tier so a strict match of
+ * every token still outranks any typo match.
+ */
+static inline score_t tokens_clamp(score_t score) {
+	return score > SCORE_MAX ? SCORE_MAX : score < SCORE_STRICT_MIN ? SCORE_STRICT_MIN : score;
+}
+
+/*
+ * Strict prefilter for all tokens in one pass. Each token owns len + 1 bits
+ * of the token mask; the state holds one bit per token, which moves up a
+ * position whenever the haystack supplies that token's next character and
+ * parks on the extra bit once the token is complete.
+ */
+static int tokens_present(const needle_info* needle, const char* haystack) {
+	if (needle->token_mask) {
+		const int m = ascii_length(haystack);
+		if (m >= 0) {
+			const uint8_t* hay = (const uint8_t*)haystack;
+			uint64_t state = needle->token_start;
+			for (int j = 0; j < m && state != needle->token_done; j++) {
+				const uint64_t hit = state & needle->token_mask[hay[j]];
+				state ^= hit | hit << 1;
+			}
+			return state == needle->token_done;
+		}
+	}
+
+	for (int t = 0; t < needle->token_count; t++) {
+		if (!strict_has_match(needle->tokens[t], haystack)) return 0;
+	}
+	return 1;
+}
+
+/* SCORE_BELOW_THRESHOLD when some token matches neither strictly nor as a typo */
+static score_t tokens_score(const needle_info* needle, const char* haystack) {
+	const int present = tokens_present(needle, haystack);
+	if (!present && !needle->typo_max) return SCORE_BELOW_THRESHOLD;
+
+	score_t total = 0;
+	int distance = 0;
+	for (int t = 0; t < needle->token_count; t++) {
+		const needle_info* token = needle->tokens[t];
+		if (present || strict_has_match(token, haystack)) {
+			total += match_score(token, haystack);
+			continue;
+		}
+
+		if (!token->typo_max) return SCORE_BELOW_THRESHOLD;
+		const int d = match_typo_distance(token, haystack, token->typo_max);
+		if (d > token->typo_max) return SCORE_BELOW_THRESHOLD;
+		distance += d;
+	}
+
+	if (distance) return SCORE_TYPO(distance < MATCH_TYPO_MAX ? distance : MATCH_TYPO_MAX);
+	return tokens_clamp(total);
+}
+
+static int compare_positions(const void* a, const void* b) {
+	return *(const int*)a - *(const int*)b;
+}
+
+/*
+ * Token positions are not in needle order: they come back sorted and
+ * without duplicates, padded with -1 up to the needle length.
+ */
+static score_t tokens_positions(const needle_info* needle, const char* haystack, int* positions,
+                                MatchScratch* scratch) {
+	const score_t score = tokens_score(needle, haystack);
+	if (score <= SCORE_BELOW_THRESHOLD || !positions) return score;
+
+	int count = 0;
+	for (int t = 0; t < needle->token_count; t++) {
+		const needle_info* token = needle->tokens[t];
+		if (!strict_has_match(token, haystack)) continue;
+		match_score_positions(token, haystack, positions + count, scratch);
+		count += token->len;
+	}
+
+	qsort(positions, count, sizeof(int), compare_positions);
+	int unique = 0;
+	for (int i = 0; i < count; i++) {
+		if (positions[i] < 0) continue;
+		if (unique == 0 || positions[i] != positions[unique - 1]) positions[unique++] = positions[i];
+	}
+	for (int i = unique; i < needle->len; i++) positions[i] = -1;
+	return score;
+}
+
+int query_has_match(const needle_info* needle, const char* haystack) {
+	if (needle->tokenized) {
+		if (tokens_present(needle, haystack)) return 1;
+		return needle->typo_max && tokens_score(needle, haystack) > SCORE_BELOW_THRESHOLD;
+	}
+
+	if (strict_has_match(needle, haystack)) return 1;
+
+	score_t score;
+	return needle->typo_max && typo_match(needle, haystack, &score);
+}
+
 static inline void precompute_bonus(haystack_info *haystack) {
 	unsigned char last_ch = '/';  // Starting value
 	for (int i = 0; i < haystack->len; i++) {
@@ -232,6 +512,352 @@ static inline void match_row(const needle_info *needle,
 	}
 }
 
+/* match_row over a byte haystack; needle characters are known to be ASCII */
+static inline void match_row_ascii(const needle_info *needle,
+								const uint8_t *hay,
+								const uint8_t *bonus,
+								const int m,
+								const int row,
+								score_t* curr_D,
+								score_t* curr_M,
+								const score_t* last_D,
+								const score_t* last_M) {
+
+	const int n = needle->len;
+	const int i = row;
+
+	const uint8_t needle_char = (uint8_t)needle->chars[row];
+	const uint8_t needle_upper = (uint8_t)needle->unicode_upper[row];
+
+	score_t prev_score = SCORE_BELOW_THRESHOLD;
+	score_t gap_score = i == n - 1 ? SCORE_GAP_TRAILING : SCORE_GAP_INNER;
+
+	score_t prev_M, prev_D;
+
+	for (int j = 0; j < m; j++) {
+		if (hay[j] == needle_char || hay[j] == needle_upper) {
+			score_t score = SCORE_BELOW_THRESHOLD;
+			if (!i) {
+				score = (j * SCORE_GAP_LEADING) + bonus[j];
+			} else if (j) {
+				score = MAX(prev_M + bonus[j], prev_D + SCORE_MATCH_CONSECUTIVE);
+			}
+			prev_D = last_D[j];
+			prev_M = last_M[j];
+			curr_D[j] = score;
+			curr_M[j] = prev_score = MAX(score, prev_score + gap_score);
+		} else {
+			prev_D = last_D[j];
+			prev_M = last_M[j];
+			curr_D[j] = SCORE_BELOW_THRESHOLD;
+			curr_M[j] = prev_score = prev_score + gap_score;
+		}
+	}
+}
+
+static score_t match_score_ascii(const needle_info* needle, const uint8_t* hay, int m) {
+	const int n = needle->len;
+
+	if (!ascii_has_match(needle, hay, m)) return SCORE_BELOW_THRESHOLD;
+	if (n == m) return SCORE_MAX;
+
+	/* the largest bonus, SCORE_MATCH_SLASH, fits in a byte */
+	uint8_t bonus[m];
+	unsigned char last_ch = '/';
+	for (int j = 0; j < m; j++) {
+		bonus[j] = COMPUTE_BONUS(last_ch, hay[j]);
+		last_ch = hay[j];
+	}
+
+	score_t D[m], M[m];
+	for (int i = 0; i < n; i++) {
+		match_row_ascii(needle, hay, bonus, m, i, D, M, D, M);
+	}
+
+	return M[m - 1];
+}
+
+/*
+ * Short needles walk the haystack once with the whole DP in locals. Row i
+ * only changes where the haystack supplies needle[i], so M is kept as an
+ * anchor A with M(j) = A + gap * j and columns without any needle
+ * character cost a mask lookup. `rows` is a compile-time capacity: each
+ * instantiation is fully unrolled, and rows are visited bottom-up so row
+ * i-1 still holds the previous column when row i reads it.
+ */
+#define SHORT_NEEDLE_MAX 8
+
+static inline __attribute__((always_inline)) score_t short_kernel(const needle_info* needle,
+                                                                  const uint8_t* hay, int m,
+                                                                  const int rows) {
+	const int n = needle->len;
+	const uint64_t* char_mask = needle->char_mask;
+	score_t D[SHORT_NEEDLE_MAX], A[SHORT_NEEDLE_MAX];
+
+#pragma GCC unroll 8
+	for (int i = 0; i < rows; i++) {
+		const score_t gap = i == n - 1 ? SCORE_GAP_TRAILING : SCORE_GAP_INNER;
+		D[i] = SCORE_BELOW_THRESHOLD;
+		A[i] = SCORE_BELOW_THRESHOLD + gap;
+	}
+
+	// rows that matched in the previous column, the only valid D for a consecutive match
+	uint64_t last_hits = 0;
+	for (int j = 0; j < m; j++) {
+		const uint64_t hits = char_mask[hay[j]];
+		if (!hits) {
+			last_hits = 0;
+			continue;
+		}
+		const score_t bonus = COMPUTE_BONUS(j ? hay[j - 1] : '/', hay[j]);
+
+#pragma GCC unroll 8
+		for (int i = rows - 1; i >= 0; i--) {
+			if (!(hits >> i & 1)) continue;
+
+			const score_t gap = i == n - 1 ? SCORE_GAP_TRAILING : SCORE_GAP_INNER;
+			score_t score = SCORE_BELOW_THRESHOLD;
+			if (!i) {
+				score = (j * SCORE_GAP_LEADING) + bonus;
+			} else if (j) {
+				const score_t prev_M = A[i - 1] + (i - 1 == n - 1 ? SCORE_GAP_TRAILING : SCORE_GAP_INNER) * (j - 1);
+				const score_t prev_D = last_hits >> (i - 1) & 1 ? D[i - 1] : SCORE_BELOW_THRESHOLD;
+				score = MAX(prev_M + bonus, prev_D + SCORE_MATCH_CONSECUTIVE);
+			}
+			D[i] = score;
+			A[i] = MAX(A[i], score - gap * j);
+		}
+		last_hits = hits;
+	}
+	return A[n - 1] + SCORE_GAP_TRAILING * (m - 1);
+}
+
+static score_t match_score_short(const needle_info* needle, const uint8_t* hay, int m) {
+	const int n = needle->len;
+
+	if (!ascii_has_match(needle, hay, m)) return SCORE_BELOW_THRESHOLD;
+	if (n == m) return SCORE_MAX;
+	if (!needle->char_mask) return match_score_ascii(needle, hay, m);
+
+	switch (n) {
+	case 1: return short_kernel(needle, hay, m, 1);
+	case 2: return short_kernel(needle, hay, m, 2);
+	case 3:
+	case 4: return short_kernel(needle, hay, m, 4);
+	default: return short_kernel(needle, hay, m, SHORT_NEEDLE_MAX);
+	}
+}
+
+/*
+ * Rows from_row..n-1 of the DP, in place over D/M which hold row
+ * from_row-1 on entry. M is kept with the inner gap so the result can be
+ * extended by a longer needle; the trailing-gap variant of the last row
+ * only feeds the returned score. Instantiated for byte and codepoint
+ * haystacks by passing exactly one of `bytes` and `wide`.
+ */
+static inline __attribute__((always_inline)) score_t extend_rows(const needle_info* needle,
+                                                                 const uint8_t* bytes,
+                                                                 const uint32_t* wide,
+                                                                 const score_t* bonus,
+                                                                 int m, int from_row,
+                                                                 score_t* D, score_t* M) {
+	const int n = needle->len;
+	score_t trailing = SCORE_BELOW_THRESHOLD;
+
+	for (int i = from_row; i < n; i++) {
+		const uint32_t needle_char = needle->chars[i];
+		const uint32_t needle_upper = needle->unicode_upper[i];
+
+		score_t prev_inner = SCORE_BELOW_THRESHOLD;
+		score_t prev_trailing = SCORE_BELOW_THRESHOLD;
+		score_t prev_D = SCORE_BELOW_THRESHOLD, prev_M = SCORE_BELOW_THRESHOLD;
+
+		for (int j = 0; j < m; j++) {
+			const uint32_t c = bytes ? bytes[j] : wide[j];
+			const int match = c == needle_char || c == needle_upper;
+
+			score_t score = SCORE_BELOW_THRESHOLD;
+			if (match) {
+				if (!i) {
+					score = (j * SCORE_GAP_LEADING) + bonus[j];
+				} else if (j) {
+					score = MAX(prev_M + bonus[j], prev_D + SCORE_MATCH_CONSECUTIVE);
+				}
+			}
+			prev_D = D[j];
+			prev_M = M[j];
+
+			D[j] = score;
+			prev_inner += SCORE_GAP_INNER;
+			prev_trailing += SCORE_GAP_TRAILING;
+			if (match) {
+				prev_inner = MAX(score, prev_inner);
+				prev_trailing = MAX(score, prev_trailing);
+			}
+			M[j] = prev_inner;
+		}
+		trailing = prev_trailing;
+	}
+	return trailing;
+}
+
+static inline int16_t row_narrow(score_t v) {
+	return v > INT16_MAX ? INT16_MAX : v < INT16_MIN ? INT16_MIN : (int16_t)v;
+}
+
+/*
+ * Scores haystack and, when row is non-NULL and the needle is at most
+ * MATCH_ROW_MAX_NEEDLE long, stores its last DP row there (row must have
+ * room for MATCH_ROW_SIZE(MATCH_MAX_LEN)). If `last` is a row stored for
+ * the same haystack with the first from_row needle characters, only the
+ * remaining rows are computed. Returns 0 without a score when the needle
+ * is not a subsequence of the haystack.
+ */
+int match_score_extend(const needle_info* needle, const char* haystack_str, const int16_t* last,
+                       int from_row, int16_t* row, score_t* score) {
+	if (!haystack_str || !*haystack_str || needle->len == 0)
+		return 0;
+
+	// neither do token sums, callers keep no rows for tokenized needles
+	if (needle->tokenized) {
+		*score = tokens_score(needle, haystack_str);
+		return *score > SCORE_BELOW_THRESHOLD;
+	}
+
+	// typo matches have no DP row, callers only keep rows for strict needles
+	if (needle->typo_max && !strict_has_match(needle, haystack_str))
+		return typo_match(needle, haystack_str, score);
+
+	const int n = needle->len;
+	haystack_info wide;
+	const uint8_t* bytes = NULL;
+
+	int m = needle->ascii ? ascii_length(haystack_str) : -1;
+	if (m >= 0) {
+		bytes = (const uint8_t*)haystack_str;
+		if (!ascii_has_match(needle, bytes, m)) return 0;
+	} else {
+		if (!setup_haystack_and_match(needle, &wide, haystack_str)) return 0;
+		m = wide.len;
+	}
+
+	score_t D[m], M[m];
+	if (last && from_row > 0 && from_row < n && last[0] == m) {
+		for (int j = 0; j < m; j++) {
+			D[j] = last[1 + j];
+			M[j] = last[1 + m + j];
+		}
+	} else {
+		from_row = 0;
+		for (int j = 0; j < m; j++) D[j] = M[j] = SCORE_BELOW_THRESHOLD;
+	}
+
+	score_t result;
+	if (bytes) {
+		score_t bonus[m];
+		unsigned char last_ch = '/';
+		for (int j = 0; j < m; j++) {
+			bonus[j] = COMPUTE_BONUS(last_ch, bytes[j]);
+			last_ch = bytes[j];
+		}
+		result = extend_rows(needle, bytes, NULL, bonus, m, from_row, D, M);
+	} else {
+		precompute_bonus(&wide);
+		result = extend_rows(needle, NULL, wide.chars, wide.bonus, m, from_row, D, M);
+	}
+
+	if (row && n <= MATCH_ROW_MAX_NEEDLE) {
+		row[0] = m;
+		for (int j = 0; j < m; j++) {
+			row[1 + j] = row_narrow(D[j]);
+			row[1 + m + j] = row_narrow(M[j]);
+		}
+	}
+
+	*score = n == m ? SCORE_MAX : strict_score(result);
+	return 1;
+}
+
+/*
+ * Admissible upper bound on match_score(): every needle character takes at
+ * most the largest bonus it can get anywhere in the haystack, or a
+ * consecutive match where its bigram occurs adjacent, and every unmatched
+ * column costs at least the cheapest gap. Without a char_mask the bonus is
+ * taken as the largest in the table and every step as consecutive.
+ */
+#define SCORE_BEST_BONUS SCORE_MATCH_SLASH
+#define SCORE_BEST_STEP MAX(SCORE_MATCH_CONSECUTIVE, SCORE_BEST_BONUS)
+#define SCORE_CHEAPEST_GAP MAX(SCORE_GAP_LEADING, MAX(SCORE_GAP_TRAILING, SCORE_GAP_INNER))
+
+/* One pass over a byte haystack: the subsequence check, the best bonus
+ * each needle character can get and which needle bigrams occur adjacent. */
+static score_t ascii_score_bound(const needle_info* needle, const uint8_t* hay, int m) {
+	const int n = needle->len;
+	const uint64_t* char_mask = needle->char_mask;
+
+	// needles only get a char_mask up to 64 characters
+	score_t best[64] = {0};
+
+	uint64_t consecutive = 0, prev_mask = 0;
+	unsigned char last_ch = '/';
+	int matched = 0;
+
+	for (int j = 0; j < m; j++) {
+		const uint64_t mask = char_mask[hay[j]];
+		if (mask) {
+			const score_t bonus = COMPUTE_BONUS(last_ch, hay[j]);
+			for (uint64_t bits = mask; bits; bits &= bits - 1) {
+				int i = __builtin_ctzll(bits);
+				if (bonus > best[i]) best[i] = bonus;
+			}
+			consecutive |= mask & (prev_mask << 1);
+			if (matched < n && (mask >> matched & 1)) matched++;
+		}
+		prev_mask = mask;
+		last_ch = hay[j];
+	}
+
+	if (matched < n) return SCORE_BELOW_THRESHOLD;
+	if (n == m) return SCORE_MAX;
+
+	score_t bound = best[0] + (m - n) * SCORE_CHEAPEST_GAP;
+	for (int i = 1; i < n; i++) {
+		bound += (consecutive >> i & 1) ? SCORE_BEST_STEP : best[i];
+	}
+	return bound;
+}
+
+/* SCORE_BELOW_THRESHOLD when the needle is not a subsequence of haystack */
+score_t match_score_bound(const needle_info* needle, const char* haystack_str) {
+	if (!haystack_str || !*haystack_str || needle->len == 0)
+		return SCORE_BELOW_THRESHOLD;
+
+	// the token bounds add up like the scores do
+	if (needle->tokenized) {
+		if (needle->typo_max) return SCORE_MAX;
+		if (!tokens_present(needle, haystack_str)) return SCORE_BELOW_THRESHOLD;
+
+		score_t bound = 0;
+		for (int t = 0; t < needle->token_count; t++) {
+			bound += match_score_bound(needle->tokens[t], haystack_str);
+		}
+		return tokens_clamp(bound);
+	}
+
+	if (needle->char_mask) {
+		int m = ascii_length(haystack_str);
+		if (m >= 0) return strict_score(ascii_score_bound(needle, (const uint8_t*)haystack_str, m));
+	}
+
+	haystack_info haystack;
+	if (!setup_haystack_and_match(needle, &haystack, haystack_str)) return SCORE_BELOW_THRESHOLD;
+
+	const int n = needle->len;
+	const int m = haystack.len;
+	if (n == m) return SCORE_MAX;
+	return strict_score(SCORE_BEST_BONUS + (n - 1) * SCORE_BEST_STEP + (m - n) * SCORE_CHEAPEST_GAP);
+}
+
 score_t match_score(const needle_info* needle, const char* haystack_str) {
 	if (*haystack_str == '\0') {
 		return SCORE_BELOW_THRESHOLD;
@@ -241,6 +867,24 @@ score_t match_score(const needle_info* needle, const char* haystack_str) {
 		return SCORE_BELOW_THRESHOLD;
 	}
 
+	if (needle->tokenized) {
+		return tokens_score(needle, haystack_str);
+	}
+
+	if (needle->typo_max && !strict_has_match(needle, haystack_str)) {
+		score_t score;
+		return typo_match(needle, haystack_str, &score) ? score : SCORE_BELOW_THRESHOLD;
+	}
+
+	if (needle->ascii) {
+		int m = ascii_length(haystack_str);
+		if (m >= 0) {
+			const uint8_t* hay = (const uint8_t*)haystack_str;
+			return strict_score(needle->len <= SHORT_NEEDLE_MAX ? match_score_short(needle, hay, m)
+			                                                    : match_score_ascii(needle, hay, m));
+		}
+	}
+
 	haystack_info haystack;
 	if (!setup_haystack_and_match(needle, &haystack, haystack_str)) return SCORE_BELOW_THRESHOLD;
 	precompute_bonus(&haystack);
@@ -276,7 +920,7 @@ score_t match_score_with_haystack(const needle_info* needle, haystack_info* hays
 		match_row(needle, haystack, i, D, M, D, M);
 	}
 
-	return M[m - 1];
+	return strict_score(M[m - 1]);
 }
 
 score_t match_score_column_major(
@@ -294,14 +938,14 @@ score_t match_score_column_major(
     // When n == 1, row 0 is also the last row
     const score_t gap_row0 = (n == 1) ? SCORE_GAP_TRAILING : SCORE_GAP_INNER;
 
-    // Handle j == 0 separately (only if start_col == 0)
+    // Handle j == 0 separately (only if start_col == 0); only row 0 can match there
     if (start_col == 0) {
         uint32_t hay_char = haystack->chars[0];
         score_t bonus = haystack->bonus[0];
 
         for (int i = 0; i < n; i++) {
-            if (hay_char == needle->chars[i] || hay_char == needle->unicode_upper[i]) {
-                cache[i] = (CacheCell){bonus, bonus};
+            if (!i && (hay_char == needle->chars[0] || hay_char == needle->unicode_upper[0])) {
+                cache[0] = (CacheCell){bonus, bonus};
             } else {
                 score_t gap = (i == n - 1) ? SCORE_GAP_TRAILING : SCORE_GAP_INNER;
                 cache[i] = (CacheCell){SCORE_BELOW_THRESHOLD, SCORE_BELOW_THRESHOLD + gap};
@@ -343,40 +987,308 @@ score_t match_score_column_major(
         }
     }
 
-    return cache[(m - 1) * n + (n - 1)].M;
+    return strict_score(cache[(m - 1) * n + (n - 1)].M);
 }
 
-score_t match_positions(const needle_info *needle, const char *haystack_str, int *positions) {
-	if (!needle || needle->len == 0)
-		return SCORE_MIN;
+/*
+ * Batch scoring: the same DP as match_score_with_haystack, but with W
+ * haystacks interleaved across the lanes of a vector. Column j of every
+ * lane is stored contiguously, and the needle rows are walked per column
+ * with D/M kept per row, so every lane advances in lockstep. Lanes shorter
+ * than the longest haystack in the batch are padded with NUL, which never
+ * matches a needle character, and their result is latched once j reaches
+ * their own length.
+ */
+#define BATCH_MAX_LANES 16
+#define BATCH_MAX_NEEDLE 64
+#define BATCH_MAX_HAYSTACK 256
+
+typedef struct {
+    uint32_t chars[BATCH_MAX_HAYSTACK * BATCH_MAX_LANES];
+    score_t bonus[BATCH_MAX_HAYSTACK * BATCH_MAX_LANES];
+    int32_t len[BATCH_MAX_LANES];
+    int index[BATCH_MAX_LANES];
+    int m_max;
+} batch_lanes;
+
+typedef void (*batch_kernel)(const needle_info* needle, const batch_lanes* lanes, score_t* out);
+
+#define VEC_MAX(a, b) ({ __typeof__(a) _m = (a) > (b); ((a) & _m) | ((b) & ~_m); })
+#define VEC_BLEND(mask, a, b) (((a) & (mask)) | ((b) & ~(mask)))
+
+#define DEFINE_BATCH_KERNEL(NAME, TARGET, W)                                            \
+typedef int32_t NAME##_vec __attribute__((vector_size((W) * sizeof(int32_t))));         \
+__attribute__((target(TARGET)))                                                          \
+static void NAME(const needle_info* needle, const batch_lanes* lanes, score_t* out) {   \
+    typedef NAME##_vec vec;                                                              \
+    const int n = needle->len;                                                           \
+    const vec below = (vec){} + SCORE_BELOW_THRESHOLD;                                   \
+    vec D[BATCH_MAX_NEEDLE], M[BATCH_MAX_NEEDLE];                                        \
+    for (int i = 0; i < n; i++) D[i] = M[i] = below;                                     \
+                                                                                         \
+    vec len, result = below;                                                             \
+    memcpy(&len, lanes->len, sizeof(vec));                                               \
+                                                                                         \
+    for (int j = 0; j < lanes->m_max; j++) {                                             \
+        vec hay_char, bonus;                                                             \
+        memcpy(&hay_char, lanes->chars + j * (W), sizeof(vec));                          \
+        memcpy(&bonus, lanes->bonus + j * (W), sizeof(vec));                             \
+                                                                                         \
+        vec diag_D = below, diag_M = below;                                              \
+        for (int i = 0; i < n; i++) {                                                    \
+            const vec match = (hay_char == (int32_t)needle->chars[i]) |                  \
+                              (hay_char == (int32_t)needle->unicode_upper[i]);           \
+            const score_t gap = (i == n - 1) ? SCORE_GAP_TRAILING : SCORE_GAP_INNER;     \
+                                                                                         \
+            vec score;                                                                   \
+            if (!i) score = bonus + j * SCORE_GAP_LEADING;                               \
+            else if (j) score = VEC_MAX(diag_M + bonus, diag_D + SCORE_MATCH_CONSECUTIVE); \
+            else score = below;                                                          \
+                                                                                         \
+            const vec left_M = M[i];                                                     \
+            diag_D = D[i];                                                               \
+            diag_M = left_M;                                                             \
+            const vec gapped = left_M + gap;                                             \
+            D[i] = VEC_BLEND(match, score, below);                                       \
+            M[i] = VEC_BLEND(match, VEC_MAX(score, gapped), gapped);                     \
+        }                                                                                \
+        result = VEC_BLEND(len == j + 1, M[n - 1], result);                              \
+    }                                                                                    \
+                                                                                         \
+    memcpy(out, &result, sizeof(vec));                                                   \
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+DEFINE_BATCH_KERNEL(batch_kernel_avx512, "avx512f", 16)
+DEFINE_BATCH_KERNEL(batch_kernel_avx2, "avx2", 8)
+DEFINE_BATCH_KERNEL(batch_kernel_sse4, "sse4.1", 4)
+#endif
+
+static batch_kernel batch_kernel_fn;
+static int batch_width = -1;
+
+static int batch_select_kernel(void) {
+    int width = __atomic_load_n(&batch_width, __ATOMIC_ACQUIRE);
+    if (width >= 0) return width;
+
+    batch_kernel fn = NULL;
+    width = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        fn = batch_kernel_avx512;
+        width = 16;
+    } else if (__builtin_cpu_supports("avx2")) {
+        fn = batch_kernel_avx2;
+        width = 8;
+    } else if (__builtin_cpu_supports("sse4.1")) {
+        fn = batch_kernel_sse4;
+        width = 4;
+    }
+#endif
+    batch_kernel_fn = fn;
+    __atomic_store_n(&batch_width, width, __ATOMIC_RELEASE);
+    return width;
+}
+
+/* Decode haystack into lane `lane` of the batch. Returns 1 if the needle
+ * is a subsequence and the candidate needs the DP, 0 if it is decided. */
+static int batch_load_lane(const needle_info* needle, batch_lanes* lanes, int lane, int width,
+                           const char* haystack_str, score_t* score) {
+    const uint32_t *n_chars = needle->chars;
+    const uint32_t *n_upper = needle->unicode_upper;
+    unsigned char last_ch = '/';
+    int pos = 0;
+
+    while (*haystack_str && pos < BATCH_MAX_HAYSTACK) {
+        int char_len;
+        uint32_t curr = haystack_codepoint(haystack_str, &char_len);
+        lanes->chars[pos * width + lane] = curr;
+        lanes->bonus[pos * width + lane] = COMPUTE_BONUS(last_ch, (unsigned char)curr);
+        last_ch = (unsigned char)curr;
+        haystack_str += char_len;
+        pos++;
+
+        if (*n_chars && (curr == *n_chars || curr == *n_upper)) {
+            n_chars++;
+            n_upper++;
+        }
+    }
+
+    if (*n_chars) {
+        *score = SCORE_BELOW_THRESHOLD;
+        return 0;
+    }
+    if (pos == needle->len) {
+        *score = SCORE_MAX;
+        return 0;
+    }
+
+    lanes->len[lane] = pos;
+    if (pos > lanes->m_max) lanes->m_max = pos;
+    return 1;
+}
+
+static void batch_flush(const needle_info* needle, batch_lanes* lanes, int width, int used, score_t* scores) {
+    if (!used) return;
+
+    for (int lane = used; lane < width; lane++) lanes->len[lane] = 0;
+    for (int j = 0; j < lanes->m_max; j++) {
+        for (int lane = 0; lane < width; lane++) {
+            if (j >= lanes->len[lane]) {
+                lanes->chars[j * width + lane] = 0;
+                lanes->bonus[j * width + lane] = 0;
+            }
+        }
+    }
+
+    score_t out[BATCH_MAX_LANES];
+    batch_kernel_fn(needle, lanes, out);
+    for (int lane = 0; lane < used; lane++) scores[lanes->index[lane]] = strict_score(out[lane]);
+    lanes->m_max = 0;
+}
+
+void match_score_batch(const needle_info* needle, const char* const* haystacks, int count, score_t* scores) {
+    if (!needle || needle->len == 0) {
+        for (int k = 0; k < count; k++) scores[k] = SCORE_BELOW_THRESHOLD;
+        return;
+    }
+
+    const int width = batch_select_kernel();
+    if (!width || needle->len > BATCH_MAX_NEEDLE || needle->typo_max || needle->tokenized) {
+        for (int k = 0; k < count; k++)
+            scores[k] = haystacks[k] ? match_score(needle, haystacks[k]) : SCORE_BELOW_THRESHOLD;
+        return;
+    }
+
+    batch_lanes lanes;
+    lanes.m_max = 0;
+    int used = 0;
+
+    for (int k = 0; k < count; k++) {
+        const char* haystack_str = haystacks[k];
+        if (!haystack_str || !*haystack_str) {
+            scores[k] = SCORE_BELOW_THRESHOLD;
+            continue;
+        }
+
+        /* Long candidates would blow up the interleaved buffers for every
+         * other lane, so they take the scalar path. */
+        if (strnlen(haystack_str, BATCH_MAX_HAYSTACK + 1) > BATCH_MAX_HAYSTACK) {
+            scores[k] = match_score(needle, haystack_str);
+            continue;
+        }
+
+        if (!batch_load_lane(needle, &lanes, used, width, haystack_str, &scores[k])) continue;
+
+        lanes.index[used++] = k;
+        if (used == width) {
+            batch_flush(needle, &lanes, width, used, scores);
+            used = 0;
+        }
+    }
+
+    batch_flush(needle, &lanes, width, used, scores);
+}
+
+/*
+ * Scratch of the calling thread when match_score_positions gets none. A long
+ * needle against a long haystack needs n * m cells, so anything past
+ * SCRATCH_KEEP_CELLS is released again right after the match, and the rest
+ * is released when the thread exits.
+ */
+#define SCRATCH_KEEP_CELLS (16 * 1024)
+
+static __thread MatchScratch thread_scratch;
+static __thread int thread_scratch_registered;
+static pthread_key_t thread_scratch_key;
+static pthread_once_t thread_scratch_once = PTHREAD_ONCE_INIT;
+static int thread_scratch_key_ok;
+
+static void thread_scratch_destroy(void* scratch) {
+	match_scratch_free(scratch);
+}
+
+static void thread_scratch_key_init(void) {
+	thread_scratch_key_ok = pthread_key_create(&thread_scratch_key, thread_scratch_destroy) == 0;
+}
+
+static MatchScratch* get_thread_scratch(void) {
+	if (!thread_scratch_registered) {
+		pthread_once(&thread_scratch_once, thread_scratch_key_init);
+		if (thread_scratch_key_ok)
+			pthread_setspecific(thread_scratch_key, &thread_scratch);
+		thread_scratch_registered = 1;
+	}
+	return &thread_scratch;
+}
+
+static int scratch_reserve(MatchScratch* scratch, int cells) {
+	if (scratch->capacity >= cells)
+		return 1;
+
+	int capacity = scratch->capacity ? scratch->capacity : INITIAL_CAPACITY;
+	while (capacity < cells)
+		capacity *= 2;
+
+	score_t* D = realloc(scratch->D, sizeof(score_t) * capacity);
+	if (!D) return 0;
+	scratch->D = D;
+
+	score_t* M = realloc(scratch->M, sizeof(score_t) * capacity);
+	if (!M) return 0;
+	scratch->M = M;
+
+	scratch->capacity = capacity;
+	return 1;
+}
+
+void match_scratch_free(MatchScratch* scratch) {
+	free(scratch->D);
+	free(scratch->M);
+	scratch->D = scratch->M = NULL;
+	scratch->capacity = 0;
+}
+
+score_t match_score_positions(const needle_info* needle, const char* haystack_str, int* positions,
+                              MatchScratch* scratch) {
+	if (!needle || needle->len == 0 || !haystack_str)
+		return SCORE_BELOW_THRESHOLD;
+
+	if (needle->tokenized)
+		return tokens_positions(needle, haystack_str, positions, scratch);
 
 	haystack_info haystack;
-	setup_haystack_and_match(needle, &haystack, haystack_str);
-	precompute_bonus(&haystack);
+	if (!setup_haystack_and_match(needle, &haystack, haystack_str))
+		return SCORE_BELOW_THRESHOLD;
 
 	const int n = needle->len;
 	const int m = haystack.len;
 
-	if (m > MATCH_MAX_LEN || n > m) {
-		/*
-		 * Unreasonably large candidate: return no score
-		 * If it is a valid match it will still be returned, it will
-		 * just be ranked below any reasonably sized candidates
-		 */
-		return SCORE_MIN;
+	if (n == m) {
+		/* Same as match_score: an exact (case-insensitive) match covers every character */
+		if (positions)
+			for (int i = 0; i < n; i++) positions[i] = i;
+		return SCORE_MAX;
 	}
 
+	precompute_bonus(&haystack);
+
 	/*
 	 * D[][] Stores the best score for this position ending with a match.
 	 * M[][] Stores the best possible score at this position.
+	 * Rows are m wide, so only the needle x haystack area is touched.
 	 */
-	score_t (*D)[MATCH_MAX_LEN], (*M)[MATCH_MAX_LEN];
-	M = malloc(sizeof(score_t) * MATCH_MAX_LEN * n);
-	D = malloc(sizeof(score_t) * MATCH_MAX_LEN * n);
+	if (!scratch) scratch = get_thread_scratch();
+	if (!scratch_reserve(scratch, n * m))
+		return SCORE_BELOW_THRESHOLD;
 
-	match_row(needle, &haystack, 0, D[0], M[0], D[0], M[0]);
+	score_t* D = scratch->D;
+	score_t* M = scratch->M;
+
+	match_row(needle, &haystack, 0, D, M, D, M);
 	for (int i = 1; i < n; i++) {
-		match_row(needle, &haystack, i, D[i], M[i], D[i - 1], M[i - 1]);
+		match_row(needle, &haystack, i, D + i * m, M + i * m, D + (i - 1) * m, M + (i - 1) * m);
 	}
 
 	/* backtrace to find the positions of optimal matching */
@@ -392,15 +1304,16 @@ score_t match_positions(const needle_info *needle, const char *haystack_str, int
 				 * we encounter, the latest in the candidate
 				 * string.
 				 */
-				if (D[i][j] != SCORE_MIN &&
-				    (match_required || D[i][j] == M[i][j])) {
+				const score_t d = D[i * m + j];
+				if (d != SCORE_MIN &&
+				    (match_required || d == M[i * m + j])) {
 					/* If this score was determined using
 					 * SCORE_MATCH_CONSECUTIVE, the
 					 * previous character MUST be a match
 					 */
 					match_required =
 					    i && j &&
-					    M[i][j] == D[i - 1][j - 1] + SCORE_MATCH_CONSECUTIVE;
+					    M[i * m + j] == D[(i - 1) * m + j - 1] + SCORE_MATCH_CONSECUTIVE;
 					positions[i] = j--;
 					break;
 				}
@@ -408,13 +1321,18 @@ score_t match_positions(const needle_info *needle, const char *haystack_str, int
 		}
 	}
 
-	score_t result = M[n - 1][m - 1];
+	const score_t score = strict_score(M[(n - 1) * m + m - 1]);
+	if (scratch == &thread_scratch && scratch->capacity > SCRATCH_KEEP_CELLS)
+		match_scratch_free(scratch);
 
-	free(M);
-	free(D);
+	return score;
+}
 
-	return result;
+score_t match_positions(const needle_info *needle, const char *haystack_str, int *positions) {
+	if (!needle || needle->len == 0)
+		return SCORE_MIN;
 
+	return match_score_positions(needle, haystack_str, positions, NULL);
 }
 
 static void resize_if_needed(needle_info* info, int needed_size) {
@@ -450,6 +1368,48 @@ static void resize_if_needed(needle_info* info, int needed_size) {
 	}
 }
 
+// Only for queries with a space and something else, see prepare_needle()
+static int prepare_tokens(needle_info* info, const char* query) {
+	info->tokenized = 1;
+	info->signature = 0;
+	info->tokens = calloc(strlen(query) / 2 + 1, sizeof(needle_info*));
+	char* words = strdup(query);
+	if (!info->tokens || !words) {
+		free(words);
+		return 0;
+	}
+
+	int bits = 0, ascii = 1;
+	char* save = NULL;
+	for (char* word = strtok_r(words, " ", &save); word; word = strtok_r(NULL, " ", &save)) {
+		needle_info* token = prepare_needle(word);
+		if (!token) {
+			free(words);
+			return 0;
+		}
+		info->tokens[info->token_count++] = token;
+		info->signature |= token->signature;
+		ascii &= token->ascii;
+		bits += token->len + 1;
+	}
+	free(words);
+
+	if (ascii && bits <= 64) {
+		info->token_mask = calloc(128, sizeof(uint64_t));
+		int bit = 0;
+		for (int t = 0; info->token_mask && t < info->token_count; t++) {
+			const needle_info* token = info->tokens[t];
+			info->token_start |= 1ULL << bit;
+			for (int i = 0; i < token->len; i++, bit++) {
+				info->token_mask[token->chars[i]] |= 1ULL << bit;
+				info->token_mask[token->unicode_upper[i]] |= 1ULL << bit;
+			}
+			info->token_done |= 1ULL << bit++;
+		}
+	}
+	return 1;
+}
+
 needle_info* prepare_needle(const char* needle) {
 	if (!needle) {
 		return NULL;
@@ -483,35 +1443,48 @@ needle_info* prepare_needle(const char* needle) {
 		}
 
 		int char_len;
-		uint32_t decoded_char = utf8_to_codepoint(s, &char_len);
+		const uint32_t decoded_char = casefold_canonical(utf8_to_codepoint(s, &char_len));
 		info->chars[pos] = decoded_char;
-
-		// Generate uppercase variant
-		if (decoded_char >= 'a' && decoded_char <= 'z') {
-			info->unicode_upper[pos] = decoded_char - 32;
-		} else if (decoded_char >= U'à' && decoded_char <= U'þ') {
-			if (decoded_char == U'ß' || decoded_char == U'÷') {
-				info->unicode_upper[pos] = decoded_char;
-			} else {
-				info->unicode_upper[pos] = decoded_char - 32;
-			}
-		} else if (decoded_char >= 0x0101 && decoded_char <= 0x017F && (decoded_char % 2 == 1)) {
-			info->unicode_upper[pos] = decoded_char - 1; // Latin Extended-A lowercase to uppercase
-		} else {
-			info->unicode_upper[pos] = decoded_char;
-		}
+		// Folded characters also match their uppercase partner, others only themselves
+		info->unicode_upper[pos] = casefold_partner(decoded_char);
 
 		s += char_len;
 		pos++;
 	}
 	info->len = pos;
+
+	info->ascii = 1;
+	for (int i = 0; i < pos; i++) {
+		if (info->chars[i] >= 0x80 || info->unicode_upper[i] >= 0x80) info->ascii = 0;
+		info->signature |= signature_bit(info->chars[i]);
+	}
+
+	if (info->ascii && pos <= 64) {
+		info->char_mask = calloc(128, sizeof(uint64_t));
+		for (int i = 0; info->char_mask && i < pos; i++) {
+			info->char_mask[info->chars[i]] |= 1ULL << i;
+			info->char_mask[info->unicode_upper[i]] |= 1ULL << i;
+		}
+	}
+
+	// a query of only spaces has no tokens, it stays a literal needle
+	if (strchr(needle, ' ') && needle[strspn(needle, " ")] && !prepare_tokens(info, needle)) {
+		free_string_info(info);
+		return NULL;
+	}
 	return info;
 }
 
 void free_string_info(needle_info* info) {
 	if (info) {
+		for (int t = 0; t < info->token_count; t++) {
+			free_string_info(info->tokens[t]);
+		}
+		free(info->tokens);
+		free(info->token_mask);
 		free(info->chars);
 		free(info->unicode_upper);
+		free(info->char_mask);
 		free(info);
 	}
 }
@@ -12,11 +12,21 @@ typedef int32_t score_t;
 
 #define MAX(a, b) (((a) > (b)) ? (a) : (b))
 
-typedef struct {
+typedef struct needle_info {
     int len;
     int capacity;
+    int ascii;  // every needle character is 7-bit
+    uint64_t signature;  // see match_signature()
+    uint64_t* char_mask;  // ASCII needles up to 64 long: needle positions each byte matches
+    int typo_max;  // edits tolerated by the typo tier, 0 for strict subsequence matching
     uint32_t* chars;
     uint32_t* unicode_upper;
+    int tokenized;  // the query had spaces: every token has to match, in any order
+    int token_count;
+    struct needle_info** tokens;
+    uint64_t* token_mask;  // single-pass token prefilter, see tokens_have_match()
+    uint64_t token_start;
+    uint64_t token_done;
 } needle_info;
 
 typedef struct {
@@ -35,12 +45,42 @@ typedef struct {
     score_t M;
 } CacheCell;
 
+// Growable D/M rows for the positions backtrace; zero-initialise before first use.
+typedef struct {
+    int capacity;
+    score_t* D;
+    score_t* M;
+} MatchScratch;
+
+// Needle-incremental scoring keeps the last DP row of a haystack as int16
+// [m, D[0..m), M[0..m)]; scores stay within int16 up to this needle length.
+#define MATCH_ROW_MAX_NEEDLE 48
+#define MATCH_ROW_SIZE(m) (1 + 2 * (m))
+
+// The typo tier sits just above SCORE_BELOW_THRESHOLD; strict matches that
+// would score inside it are raised to SCORE_STRICT_MIN, so they always rank higher
+#define MATCH_TYPO_MAX 2
+#define MATCH_TYPO_MIN_NEEDLE 4
+#define SCORE_TYPO(distance) (SCORE_ABOVE_THRESHOLD + MATCH_TYPO_MAX - (distance))
+#define SCORE_STRICT_MIN (SCORE_TYPO(0) + 1)
+
 needle_info* prepare_needle(const char* needle);
+void needle_enable_typos(needle_info* needle);
+int match_typo_distance(const needle_info* needle, const char* haystack, int max);
 void free_string_info(needle_info* info);
 int haystack_update(haystack_info* hay, const char* str, uint16_t common_chars, haystack_index* index, const needle_info* needle);
 int query_has_match(const needle_info* needle, const char* haystack);
 int setup_haystack_and_match(const needle_info* needle, haystack_info* hay, const char* haystack_str);
 score_t match_positions(const needle_info* needle, const char* haystack, int* positions);
+uint64_t match_signature(const char* haystack);
+score_t match_score_bound(const needle_info* needle, const char* haystack);
+score_t match_score_positions(const needle_info* needle, const char* haystack, int* positions, MatchScratch* scratch);
+void match_scratch_free(MatchScratch* scratch);
 score_t match_score(const needle_info* needle, const char* haystack_str);
+void match_score_batch(const needle_info* needle, const char* const* haystacks, int count, score_t* scores);
 score_t match_score_with_haystack(const needle_info* needle, haystack_info* haystack);
+int match_score_extend(const needle_info* needle, const char* haystack, const int16_t* last, int from_row, int16_t* row, score_t* score);
 score_t match_score_column_major(const needle_info* needle, const haystack_info* haystack, int start_col, CacheCell* cache);
+
+// False when a haystack with this match_signature() cannot contain the needle
+#define match_signature_possible(needle, sig) (((sig) & (needle)->signature) == (needle)->signature)
@@ -1,5 +1,6 @@
 #include <stdatomic.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <glib-object.h>
 #include <stdio.h>
 #include <immintrin.h>
@@ -8,22 +9,57 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/mman.h>
 #include "hashset.h"
 
 #define MAX_POOLED_HASHSETS 8
+// Pooled sets keep pages and sheets for the next power of two above recent
+// result counts, and never less than this
+#define POOL_CLASS_MIN_ROWS 16384
+// Buffers past this offset ask for huge pages, small searches stay on 4k pages
+#define POOL_HUGE_FROM (2 << 20)
+// Without a new search for this long the pool drops to POOL_IDLE_KEEP small sets
+#define POOL_IDLE_SECONDS 10
+#define POOL_IDLE_KEEP 2
 #define INITIAL_UNFINISHED -1
+#define DUPLICATE_ITEM 0xFFFFFFFFULL
 
 extern int events_ok(int event_id);
 
 int hashset_merge_threads = 1;
+int hashset_top_k = HASHSET_DEFAULT_TOP_K;
+atomic_int hashset_small_merge = HASHSET_DEFAULT_SMALL_MERGE;
+atomic_int hashset_merge_grain = HASHSET_DEFAULT_MERGE_GRAIN;
+
+static void radix_select_kernels(void);
+
+static void* calibration_thread(void* data) {
+    hashset_calibrate_merge(data);
+    return NULL;
+}
 
 void hashset_init(int num_workers) {
     hashset_merge_threads = num_workers;
+    radix_select_kernels();
+
+    // the first searches keep every pool worker, the defaults hold until it is done
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, calibration_thread, NULL) == 0)
+        pthread_detach(thread);
+}
+
+void hashset_set_top_k(int top_k) {
+    hashset_top_k = top_k < 0 ? 0 : top_k;
 }
 
 static HashSet* hashset_pool[MAX_POOLED_HASHSETS];
 static _Atomic(HashSet**) pool_pos = hashset_pool;
 
+static atomic_int pool_demand;          // decaying peak of recent result counts
+static _Atomic int64_t pool_last_use;
+static atomic_bool pool_idle_pending;
+
 static inline HashSet* grab_hashset_from_pool(void) {
     HashSet** current_pos;
     __atomic_load(&pool_pos, &current_pos, __ATOMIC_RELAXED);
@@ -55,20 +91,34 @@ static void reset_hashset(HashSet* set) {
     set->score_items = NULL;
     set->matches = NULL;
     set->merge_workers = 1;
+    set->sorted_upto = 0;
+    set->head_end = 0;
 
-    size_t n = MAX_SHEETS * SHEET_SIZE;
-    memset(set->combined, 0, n * sizeof(uint32_t) * 3);
+    // The buffers reserve room for MAX_ITEMS, only clear what the last search touched
+    size_t n = atomic_load(&set->hash_size);
+    memset(set->combined, 0, n * sizeof(uint64_t));
+    set->touched = MAX(set->touched, (int)n);
+    set->touched_blocks = MAX(set->touched_blocks, MIN(atomic_load(&set->flush_blocks), MAX_FLUSH_BLOCKS));
 
-    int num_sheets = atomic_load(&set->global_index_counter);
+    int num_sheets = MIN(atomic_load(&set->global_index_counter), MAX_SHEETS);
     for (int i = 0; i < num_sheets; i++) {
         if (set->sheet_pool[i]) {
             set->sheet_pool[i]->size = 0;
         }
     }
+    set->touched_sheets = MAX(set->touched_sheets, num_sheets);
 
     atomic_store(&set->size, INITIAL_UNFINISHED);
     atomic_store(&set->hash_size, 0);
+    atomic_store(&set->flushed, 0);
+    atomic_store(&set->previewed, 0);
+    atomic_store(&set->publishing, 0);
+    atomic_store(&set->flush_blocks, 0);
     atomic_store(&set->global_index_counter, 0);
+    atomic_store(&set->dropped, 0);
+    atomic_store(&set->non_unique, 0);
+    atomic_store(&set->refs, 1);
+    atomic_store(&set->prune_threshold, 0);
     atomic_store(&set->write, 0);
 
     memset(set->unfinished_queue, 0, sizeof(set->unfinished_queue));
@@ -82,32 +132,116 @@ static HashSet* hashset_reuse(int event_id) {
     HashSet* set = grab_hashset_from_pool();
     if (!set) return NULL;
     set->event_id = event_id;
+    set->top_k = hashset_top_k;
     return set;
 }
 
+// Address space for MAX_ITEMS is reserved up front, pages are only backed once a
+// search actually writes that far. That lets the buffers grow without ever moving
+// while shards are writing into them.
+static void* reserve_items(void) {
+    void* p = mmap(NULL, MAX_ITEMS * sizeof(uint64_t), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) return NULL;
+
+#ifdef MADV_HUGEPAGE
+    // Only searches this large scatter over enough memory to miss the TLB
+    const uintptr_t huge = ((uintptr_t)p + POOL_HUGE_FROM + POOL_HUGE_FROM - 1) & ~(uintptr_t)(POOL_HUGE_FROM - 1);
+    const uintptr_t end = (uintptr_t)p + MAX_ITEMS * sizeof(uint64_t);
+    if (huge < end) madvise((void*)huge, end - huge, MADV_HUGEPAGE);
+#endif
+    return p;
+}
+
+static void release_items(void* items) {
+    if (items) munmap(items, MAX_ITEMS * sizeof(uint64_t));
+}
+
+static FlushBlock* reserve_blocks(void) {
+    void* p = mmap(NULL, MAX_FLUSH_BLOCKS * sizeof(FlushBlock), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+static void release_blocks(FlushBlock* blocks) {
+    if (blocks) munmap(blocks, MAX_FLUSH_BLOCKS * sizeof(FlushBlock));
+}
+
+static size_t pool_class(int rows) {
+    size_t class = POOL_CLASS_MIN_ROWS;
+    while (class < (size_t)rows && class < MAX_ITEMS) class <<= 1;
+    return class;
+}
+
+static void note_demand(int rows) {
+    int demand = atomic_load_explicit(&pool_demand, memory_order_relaxed);
+    int next;
+    do {
+        next = MAX(rows, demand - demand / 8);
+    } while (!atomic_compare_exchange_weak(&pool_demand, &demand, next));
+}
+
+static void discard_pages(void* base, size_t from, size_t to) {
+    const size_t page = sysconf(_SC_PAGESIZE);
+    from = (from + page - 1) & ~(page - 1);
+    if (to > from) madvise((char*)base + from, to - from, MADV_DONTNEED);
+}
+
+// Hands the pages and sheets past a class of rows back to the kernel. The
+// address space stays reserved, a later search that grows past it faults
+// fresh zeroed pages in again.
+static void trim_hashset(HashSet* set, size_t rows) {
+    if ((size_t)set->touched > rows) {
+        discard_pages(set->hash_items, rows * sizeof(uint64_t), set->touched * sizeof(uint64_t));
+        discard_pages(set->combined, rows * sizeof(uint64_t), set->touched * sizeof(uint64_t));
+        set->touched = rows;
+    }
+
+    // every shard leaves a sheet partly filled, so keep twice what the rows need
+    const int sheets = MIN(MAX_SHEETS, (int)(rows / SHEET_SIZE) * 2);
+    for (int i = sheets; i < set->touched_sheets; i++) {
+        free(set->sheet_pool[i]);
+        set->sheet_pool[i] = NULL;
+    }
+    set->touched_sheets = MIN(set->touched_sheets, sheets);
+
+    const int blocks = MIN(MAX_FLUSH_BLOCKS, sheets * 2);
+    if (set->touched_blocks > blocks) {
+        discard_pages(set->blocks, blocks * sizeof(FlushBlock), set->touched_blocks * sizeof(FlushBlock));
+        set->touched_blocks = blocks;
+    }
+}
+
 static HashSet* hashset_new(int event_id) {
     HashSet* set = malloc(sizeof(HashSet));
     if (!set) return NULL;
 
-    size_t n = MAX_SHEETS * SHEET_SIZE;
-
-    set->hash_items = aligned_alloc(64, n * sizeof(uint64_t));
+    set->hash_items = reserve_items();
     if (!set->hash_items) {
         free(set);
         return NULL;
     }
 
-    set->combined = aligned_alloc(64, n * sizeof(uint32_t) * 3);
+    set->combined = reserve_items();
     if (!set->combined) {
-        free(set->hash_items);
+        release_items(set->hash_items);
+        free(set);
+        return NULL;
+    }
+
+    set->blocks = reserve_blocks();
+    if (!set->blocks) {
+        release_items(set->combined);
+        release_items(set->hash_items);
         free(set);
         return NULL;
     }
 
-    set->sheet_pool = malloc(MAX_SHEETS * sizeof(ResultSheet*));
+    set->sheet_pool = calloc(MAX_SHEETS, sizeof(ResultSheet*));
     if (!set->sheet_pool) {
-        free(set->combined);
-        free(set->hash_items);
+        release_blocks(set->blocks);
+        release_items(set->combined);
+        release_items(set->hash_items);
         free(set);
         return NULL;
     }
@@ -116,8 +250,9 @@ static HashSet* hashset_new(int event_id) {
 
     if (!set->counts) {
         free(set->sheet_pool);
-        free(set->combined);
-        free(set->hash_items);
+        release_blocks(set->blocks);
+        release_items(set->combined);
+        release_items(set->hash_items);
         free(set);
         return NULL;
     }
@@ -126,12 +261,28 @@ static HashSet* hashset_new(int event_id) {
     set->matches = NULL;
     set->event_id = event_id;
     set->merge_workers = 1;
+    set->top_k = hashset_top_k;
+    set->sorted_upto = 0;
+    set->head_end = 0;
+    set->touched = 0;
+    set->touched_blocks = 0;
+    set->touched_sheets = 0;
+    set->source = NULL;
+    set->own_sheets = NULL;
 
     memset(set->unfinished_queue, 0, sizeof(set->unfinished_queue));
 
     atomic_init(&set->size, INITIAL_UNFINISHED);
     atomic_init(&set->hash_size, 0);
+    atomic_init(&set->flushed, 0);
+    atomic_init(&set->previewed, 0);
+    atomic_init(&set->publishing, 0);
+    atomic_init(&set->flush_blocks, 0);
     atomic_init(&set->global_index_counter, 0);
+    atomic_init(&set->dropped, 0);
+    atomic_init(&set->non_unique, 0);
+    atomic_init(&set->refs, 1);
+    atomic_init(&set->prune_threshold, 0);
     atomic_init(&set->write, 0);
     atomic_init(&set->read, set->unfinished_queue);
     atomic_init(&set->bar[0].v, 0);
@@ -140,6 +291,7 @@ static HashSet* hashset_new(int event_id) {
 }
 
 HashSet* hashset_create(int event_id) {
+    atomic_store_explicit(&pool_last_use, g_get_monotonic_time(), memory_order_relaxed);
     HashSet* set = hashset_reuse(event_id);
     if (set) return set;
     return hashset_new(event_id);
@@ -157,14 +309,43 @@ ResultContainer* hashset_create_handle(HashSet* hashset, const char* query, int1
     container->event_id = hashset->event_id;
     container->sheet_pool = hashset->sheet_pool;
     container->global_index_counter = &hashset->global_index_counter;
+    container->dropped = &hashset->dropped;
+    container->global_non_unique = &hashset->non_unique;
+    container->non_unique = false;
     container->read = &hashset->read;
     container->global_items_size = &hashset->hash_size;
+    container->global_items_flushed = &hashset->flushed;
+    container->global_keys = hashset->combined;
+    container->global_blocks = hashset->blocks;
+    container->global_blocks_size = &hashset->flush_blocks;
+    // merges of sets no larger than top_k sort everything and use no histogram
+    container->count_from = hashset->top_k > 0 ? hashset->top_k : INT_MAX;
     container->global_items = hashset->hash_items;
 
     container->current_sheet = NULL;
     container->match_mre_idx = 0;
     container->local_items_size = 0;
 
+    container->prune_threshold = &hashset->prune_threshold;
+    container->top_k = hashset->top_k <= PRUNE_MAX_TOP_K ? hashset->top_k : 0;
+    container->top = NULL;
+    container->top_size = 0;
+    container->published = 0;
+
+    container->candidates = NULL;
+    container->candidates_size = 0;
+    container->candidates_capacity = 0;
+    container->record_candidates = false;
+    container->candidates_lost = false;
+    container->rows = (CandidateRows){0};
+
+    container->previous_ids = NULL;
+    container->previous_offsets = NULL;
+    container->previous_rows = NULL;
+    container->previous_count = 0;
+    container->previous_cursor = 0;
+    container->previous_needle_len = 0;
+
     container->local_items = malloc(SHEET_SIZE * sizeof(uint64_t));
     return container;
 }
@@ -200,6 +381,7 @@ static inline void barrier_release(HashSet* s, int bi) {
 }
 
 static inline void barrier_wait(HashSet* s, int* bi) {
+    if (s->merge_workers == 1) return;  // nobody to wait for, spare the futex wake
     if (barrier_check_last(s, bi))
         barrier_release(s, *bi);
     else barrier_spin(s, *bi);
@@ -223,10 +405,449 @@ static inline void parallel_prefix_sum(HashSet* set, const int tid, uint32_t buc
     }
 }
 
+static inline uint32_t item_score(const HashSet* set, uint64_t item) {
+    return set->sheet_pool[SHEET_IDX(item)]->scores[ITEM_IDX(item)];
+}
+
+// The score sort key: score + 1, or 0 for duplicates so they sort last.
+static inline uint64_t item_key(const HashSet* set, uint64_t item) {
+    item &= 0xFFFFFFFFULL;
+    return item == DUPLICATE_ITEM ? 0 : item_score(set, item) + 1;
+}
+
+// Orders the rows of one high-byte bucket by the low score byte. The match
+// slots of a bucket are unused until it is sorted, so they serve as scratch.
+static void sort_bucket(HashSet* set, uint32_t from, uint32_t to) {
+    uint32_t* restrict items = set->score_items + from;
+    uint64_t* restrict tmp = (uint64_t*)(set->matches + from);
+    uint32_t bucket[256] = {0};
+    const uint32_t len = to - from;
+
+    for (uint32_t i = 0; i < len; i++) {
+        const uint64_t key = item_key(set, items[i]);
+        tmp[i] = (key << 32) | items[i];
+        bucket[255 - (key & 0xFF)]++;
+    }
+
+    uint32_t sum = 0;
+    for (int b = 0; b < 256; b++) {
+        uint32_t c = bucket[b];
+        bucket[b] = sum;
+        sum += c;
+    }
+
+    for (uint32_t i = 0; i < len; i++)
+        items[bucket[255 - ((tmp[i] >> 32) & 0xFF)]++] = (uint32_t)tmp[i];
+}
+
+// The rows a top-K merge appended past its head, ordered by their high score
+// byte the first time something reads that far.
+static void bucket_tail(HashSet* set) {
+    const uint32_t head = set->head_end;
+    const uint32_t len = atomic_load(&set->hash_size) - head;
+    uint32_t* restrict items = set->score_items + head;
+    uint64_t* restrict tmp = (uint64_t*)(set->matches + head);
+    uint32_t bucket[256] = {0};
+
+    for (uint32_t i = 0; i < len; i++) {
+        const uint64_t key = item_key(set, items[i]);
+        tmp[i] = (key << 32) | items[i];
+        bucket[255 - (key >> 8)]++;
+    }
+
+    // buckets up to the head's threshold are empty here and keep their end
+    uint32_t sum = 0;
+    for (int b = 0; b < 256; b++) {
+        const uint32_t c = bucket[b];
+        bucket[b] = sum;
+        sum += c;
+        set->bucket_end[b] = MAX(set->bucket_end[b], head + sum);
+    }
+
+    for (uint32_t i = 0; i < len; i++)
+        items[bucket[255 - (tmp[i] >> 40)]++] = (uint32_t)tmp[i];
+
+    set->head_end = head + len;
+}
+
+static void hashset_sort_until(HashSet* set, int index) {
+    if (index >= set->head_end) bucket_tail(set);
+
+    uint32_t from = 0;
+    for (int b = 0; b < 256 && set->sorted_upto <= index; b++) {
+        const uint32_t to = set->bucket_end[b];
+        if (to > (uint32_t)set->sorted_upto) {
+            if (to - from > 1) sort_bucket(set, from, to);
+            set->sorted_upto = to;
+        }
+        from = to;
+    }
+}
+
+// === Radix kernels ===
+
+// Digits are extracted a batch at a time, a loop the compiler vectorizes
+#define RADIX_BATCH 256
+// Fewer rows per worker than this scatter straight, their buckets stay in cache
+#define RADIX_LINES_MIN_ROWS 65536
+// From this many rows in the set full lines bypass the cache on their way out
+#define RADIX_STREAM_MIN_ROWS (1 << 20)
+
+typedef void (*histogram_fn)(const uint64_t* src, uint32_t from, uint32_t to, int shift, uint8_t flip,
+                             uint32_t bucket[256]);
+typedef void (*scatter64_fn)(const uint64_t* src, uint64_t* dst, uint32_t from, uint32_t to, int shift,
+                             uint8_t flip, uint32_t bucket[256], bool stream);
+typedef void (*scatter32_fn)(const uint64_t* src, uint32_t* dst, uint32_t from, uint32_t to, int shift,
+                             uint8_t flip, uint32_t bucket[256], bool stream);
+
+#define RADIX_DIGIT(v, shift, flip) ((uint8_t)(((v) >> (shift)) ^ (flip)))
+
+__attribute__((target("sse2")))
+static inline void stream_line_sse2(void* dst, const void* src) {
+    const __m128i* s = src;
+    __m128i* d = dst;
+    for (int k = 0; k < 4; k++) _mm_stream_si128(d + k, _mm_load_si128(s + k));
+}
+
+__attribute__((target("avx2")))
+static inline void stream_line_avx2(void* dst, const void* src) {
+    const __m256i* s = src;
+    __m256i* d = dst;
+    _mm256_stream_si256(d, _mm256_load_si256(s));
+    _mm256_stream_si256(d + 1, _mm256_load_si256(s + 1));
+}
+
+// Counts one digit (flipped, so 0xFF sorts descending) of src[from, to).
+// Four banks of counters take turns, a run of equal digits, common in the
+// high score byte, does not wait on its own previous increment.
+#define DEFINE_HISTOGRAM(NAME, TARGET)                                                          \
+__attribute__((target(TARGET)))                                                                  \
+static void NAME(const uint64_t* restrict src, uint32_t from, uint32_t to, int shift, uint8_t flip, \
+                 uint32_t bucket[256]) {                                                         \
+    uint32_t banks[4][256] __attribute__((aligned(64))) = {{0}};                                 \
+    uint8_t digits[RADIX_BATCH];                                                                 \
+                                                                                                 \
+    for (uint32_t i = from; i < to; i += RADIX_BATCH) {                                          \
+        const uint32_t len = MIN(RADIX_BATCH, to - i);                                           \
+        for (uint32_t k = 0; k < len; k++) digits[k] = RADIX_DIGIT(src[i + k], shift, flip);     \
+                                                                                                 \
+        uint32_t k = 0;                                                                          \
+        for (; k + 4 <= len; k += 4) {                                                           \
+            banks[0][digits[k]]++;                                                               \
+            banks[1][digits[k + 1]]++;                                                           \
+            banks[2][digits[k + 2]]++;                                                           \
+            banks[3][digits[k + 3]]++;                                                           \
+        }                                                                                        \
+        for (; k < len; k++) banks[0][digits[k]]++;                                              \
+    }                                                                                            \
+                                                                                                 \
+    for (int b = 0; b < 256; b++) bucket[b] += banks[0][b] + banks[1][b] + banks[2][b] + banks[3][b]; \
+}
+
+// Scatters src[from, to) by digit to the positions in bucket. Large ranges
+// collect each bucket's rows in a cache line of their own and write whole
+// lines, so 256 interleaved output streams cost one store per line instead
+// of one scattered store per row. The first line of a bucket is cut short
+// to reach an aligned boundary, every later one can be streamed.
+#define DEFINE_SCATTER(NAME, TARGET, OUT, STREAM)                                                \
+__attribute__((target(TARGET)))                                                                  \
+static void NAME(const uint64_t* restrict src, OUT* restrict dst, uint32_t from, uint32_t to,    \
+                 int shift, uint8_t flip, uint32_t* restrict bucket, bool stream) {                 \
+    enum { ROWS = CACHELINE / sizeof(OUT) };                                                     \
+    if (to - from < RADIX_LINES_MIN_ROWS) {                                                      \
+        for (uint32_t i = from; i < to; i++)                                                     \
+            dst[bucket[RADIX_DIGIT(src[i], shift, flip)]++] = (OUT)src[i];                       \
+        return;                                                                                  \
+    }                                                                                            \
+                                                                                                 \
+    OUT lines[256][ROWS] __attribute__((aligned(CACHELINE)));                                    \
+    uint8_t fill[256], room[256];                                                                \
+    for (int b = 0; b < 256; b++) {                                                              \
+        fill[b] = 0;                                                                             \
+        room[b] = ROWS - bucket[b] % ROWS;                                                       \
+    }                                                                                            \
+                                                                                                 \
+    for (uint32_t i = from; i < to; i++) {                                                       \
+        const uint8_t d = RADIX_DIGIT(src[i], shift, flip);                                      \
+        lines[d][fill[d]++] = (OUT)src[i];                                                       \
+        if (fill[d] < room[d]) continue;                                                         \
+                                                                                                 \
+        OUT* out = dst + bucket[d];                                                              \
+        if (room[d] < ROWS) memcpy(out, &lines[d][0], room[d] * sizeof(OUT));                    \
+        else if (stream) STREAM(out, lines[d]);                                                  \
+        else memcpy(out, lines[d], CACHELINE);                                                   \
+        bucket[d] += room[d];                                                                    \
+        fill[d] = 0;                                                                             \
+        room[d] = ROWS;                                                                          \
+    }                                                                                            \
+                                                                                                 \
+    for (int b = 0; b < 256; b++) {                                                              \
+        memcpy(dst + bucket[b], lines[b], fill[b] * sizeof(OUT));                                \
+        bucket[b] += fill[b];                                                                    \
+    }                                                                                            \
+    if (stream) _mm_sfence();                                                                    \
+}
+
+DEFINE_HISTOGRAM(histogram_sse2, "sse2")
+DEFINE_HISTOGRAM(histogram_avx2, "avx2")
+DEFINE_SCATTER(scatter64_sse2, "sse2", uint64_t, stream_line_sse2)
+DEFINE_SCATTER(scatter64_avx2, "avx2", uint64_t, stream_line_avx2)
+DEFINE_SCATTER(scatter32_sse2, "sse2", uint32_t, stream_line_sse2)
+DEFINE_SCATTER(scatter32_avx2, "avx2", uint32_t, stream_line_avx2)
+
+static histogram_fn radix_histogram = histogram_sse2;
+static scatter64_fn radix_scatter64 = scatter64_sse2;
+static scatter32_fn radix_scatter32 = scatter32_sse2;
+
+static void radix_select_kernels(void) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        radix_histogram = histogram_avx2;
+        radix_scatter64 = scatter64_avx2;
+        radix_scatter32 = scatter32_avx2;
+    }
+}
+
+static inline void sift_down(uint64_t* a, int64_t root, int64_t n) {
+    for (int64_t child; (child = 2 * root + 1) < n; root = child) {
+        if (child + 1 < n && a[child + 1] < a[child]) child++;
+        if (a[root] <= a[child]) return;
+        const uint64_t t = a[root];
+        a[root] = a[child];
+        a[child] = t;
+    }
+}
+
+// Descending introsort: median of three quicksort, insertion sort for short
+// ranges and heapsort once the partitions stop shrinking. Keys are distinct,
+// the item index sits in their low bits.
+static void sort_descending(uint64_t* a, int64_t n, int depth) {
+    while (n > 24) {
+        if (depth-- == 0) {
+            for (int64_t i = n / 2 - 1; i >= 0; i--) sift_down(a, i, n);
+            for (int64_t i = n - 1; i > 0; i--) {
+                const uint64_t t = a[0];
+                a[0] = a[i];
+                a[i] = t;
+                sift_down(a, 0, i);
+            }
+            return;
+        }
+
+        const uint64_t x = a[0], y = a[n / 2], z = a[n - 1];
+        const uint64_t pivot = x < y ? (y < z ? y : (x < z ? z : x)) : (x < z ? x : (y < z ? z : y));
+        int64_t i = 0, j = n - 1;
+        for (;;) {
+            while (a[i] > pivot) i++;
+            while (a[j] < pivot) j--;
+            if (i >= j) break;
+            const uint64_t t = a[i];
+            a[i++] = a[j];
+            a[j--] = t;
+        }
+
+        // recurse into the smaller side, loop on the larger
+        const int64_t left = j + 1;
+        if (left < n - left) {
+            sort_descending(a, left, depth);
+            a += left;
+            n -= left;
+        } else {
+            sort_descending(a + left, n - left, depth);
+            n = left;
+        }
+    }
+
+    for (int64_t i = 1; i < n; i++) {
+        const uint64_t v = a[i];
+        int64_t k = i;
+        for (; k > 0 && a[k - 1] < v; k--) a[k] = a[k - 1];
+        a[k] = v;
+    }
+}
+
+static void sort_keys(uint64_t* keys, int64_t n) {
+    sort_descending(keys, n, 2 * (64 - __builtin_clzll(n | 1)));
+}
+
+// A single worker with few rows: one comparison sort costs less than the
+// radix passes with their full size histograms.
+static int merge_small(HashSet* set, const int64_t n, const bool non_unique) {
+    uint64_t* restrict hash_items = set->hash_items;
+    uint64_t* restrict keys = set->combined;
+    int dups = 0;
+
+    if (non_unique) {
+        // only adjacency of equal hashes matters here, not the direction
+        sort_keys(hash_items, n);
+        for (int64_t i = 1; i < n; i++) {
+            const uint64_t a = hash_items[i - 1];
+            const uint64_t b = hash_items[i];
+            if ((a >> 32) == (b >> 32)) {
+                if (item_score(set, b) < item_score(set, a)) hash_items[i] = a;
+                hash_items[i - 1] |= DUPLICATE_ITEM;
+                dups++;
+            }
+        }
+    }
+
+    // unique sets had their keys written while the shards flushed
+    if (non_unique || atomic_load_explicit(&set->flush_blocks, memory_order_relaxed) > MAX_FLUSH_BLOCKS) {
+        for (int64_t i = 0; i < n; i++)
+            keys[i] = (item_key(set, hash_items[i]) << 32) | (hash_items[i] & 0xFFFFFFFFULL);
+    }
+    sort_keys(keys, n);
+
+    uint32_t* dest = (uint32_t*)hash_items;
+    for (int64_t i = 0; i < n; i++)
+        dest[i] = (uint32_t)keys[i];
+
+    set->score_items = dest;
+    set->matches = (BobLauncherMatch**)set->combined;
+    set->sorted_upto = n;
+    set->head_end = n;
+    return dups;
+}
+
+static int merge_done(HashSet* set, const int64_t n, const int dups) {
+    int dropped = atomic_load_explicit(&set->dropped, memory_order_relaxed);
+    if (dropped) {
+        g_warning("Result set is full, %d results were dropped", dropped);
+    }
+    atomic_fetch_add_explicit(&set->size, n - dups - INITIAL_UNFINISHED, memory_order_release);
+    return 1;
+}
+
+int hashset_plan_merge(HashSet* set) {
+    const int64_t n = atomic_load(&set->hash_size);
+    const int64_t workers = 1 + n / atomic_load_explicit(&hashset_merge_grain, memory_order_relaxed);
+    if (workers < set->merge_workers) set->merge_workers = workers;
+    return set->merge_workers;
+}
+
+// Partitions below this size are deduped through a table on the stack with
+// twice as many slots, larger ones are ordered by the rest of their hash first
+#define PARTITION_TABLE_ROWS 8192
+
+static inline bool keep_first(const HashSet* set, uint64_t a, uint64_t b) {
+    return item_score(set, b) < item_score(set, a);
+}
+
+// Copies tmp[from, to), rows that share their low hash byte, to hash_items and
+// marks every duplicate but the best scoring one. Partitions are small, so
+// one pass of lookups in a table that fits in cache does the work of three
+// radix passes over the remaining hash bytes.
+static int dedup_partition(HashSet* set, uint32_t from, uint32_t to) {
+    uint64_t* restrict tmp = set->combined;
+    uint64_t* restrict hash_items = set->hash_items;
+    const uint32_t len = to - from;
+    int dups = 0;
+
+    if (len < PARTITION_TABLE_ROWS) {
+        uint16_t table[2 * PARTITION_TABLE_ROWS];
+        const int bits = 33 - __builtin_clz(len | 1);
+        const uint32_t mask = (1u << bits) - 1;
+        memset(table, 0, sizeof(uint16_t) << bits);
+
+        for (uint32_t i = 0; i < len; i++) {
+            const uint64_t row = tmp[from + i];
+            uint32_t slot = ((uint32_t)(row >> 40) * 0x9E3779B1u) >> (32 - bits);
+            hash_items[from + i] = row;
+
+            for (;; slot = (slot + 1) & mask) {
+                if (!table[slot]) {
+                    table[slot] = i + 1;
+                    break;
+                }
+                uint64_t* seen = &hash_items[from + table[slot] - 1];
+                if ((*seen >> 32) != (row >> 32)) continue;
+
+                if (keep_first(set, *seen, row)) {
+                    hash_items[from + i] |= DUPLICATE_ITEM;
+                } else {
+                    *seen |= DUPLICATE_ITEM;
+                    table[slot] = i + 1;
+                }
+                dups++;
+                break;
+            }
+        }
+        return dups;
+    }
+
+    for (int shift = 40; shift < 64; shift += 8) {
+        // three passes, so the partition ends up back in hash_items
+        const bool odd = shift & 8;
+        uint64_t* restrict src = odd ? tmp : hash_items;
+        uint64_t* restrict dst = odd ? hash_items : tmp;
+        uint32_t bucket[256] = {0};
+
+        radix_histogram(src, from, to, shift, 0, bucket);
+        uint32_t sum = from;
+        for (int b = 0; b < 256; b++) {
+            const uint32_t c = bucket[b];
+            bucket[b] = sum;
+            sum += c;
+        }
+        radix_scatter64(src, dst, from, to, shift, 0, bucket, false);
+    }
+
+    for (uint32_t i = from + 1; i < to; i++) {
+        const uint64_t a = hash_items[i - 1];
+        const uint64_t b = hash_items[i];
+        if ((a >> 32) == (b >> 32)) {
+            if (keep_first(set, a, b)) hash_items[i] = a; // move the highest scoring candidate forwards.
+            hash_items[i - 1] |= DUPLICATE_ITEM;
+            dups++;
+        }
+    }
+    return dups;
+}
+
+// parallel_prefix_sum for the top-K merge. Only the high score bytes that
+// cover the first top_k rows get offsets, every row past them goes to this
+// worker's stretch of the tail, which bucket_tail() orders on demand.
+static int split_top_k(HashSet* set, const int tid, uint32_t bucket[256], uint32_t* tail, int* bi) {
+    memcpy(set->counts[tid], bucket, sizeof(uint32_t) * 256);
+
+    barrier_wait(set, bi);
+
+    uint32_t head = 0;
+    int threshold = 0;
+    for (; threshold < 255; threshold++) {
+        for (int t = 0; t < set->merge_workers; t++)
+            head += set->counts[t][threshold];
+        if (head >= (uint32_t)set->top_k) break;
+    }
+    if (threshold == 255) {
+        for (int t = 0; t < set->merge_workers; t++)
+            head += set->counts[t][255];
+    }
+
+    uint32_t bucket_base = 0;
+    for (int b = 0; b <= threshold; b++) {
+        for (int t = 0; t < tid; t++)
+            bucket_base += set->counts[t][b];
+        bucket[b] = bucket_base;
+        for (int t = tid; t < set->merge_workers; t++)
+            bucket_base += set->counts[t][b];
+    }
+
+    *tail = head;
+    for (int t = 0; t < tid; t++)
+        for (int b = threshold + 1; b < 256; b++)
+            *tail += set->counts[t][b];
+    return threshold;
+}
+
 int merge_hashset_parallel(HashSet* set, int tid) {
     uint32_t bucket[256] = {0};
 
     const int64_t n = atomic_load(&set->hash_size);
+    const bool non_unique = atomic_load_explicit(&set->non_unique, memory_order_relaxed);
+    if (set->merge_workers == 1 && n <= atomic_load_explicit(&hashset_small_merge, memory_order_relaxed))
+        return merge_done(set, n, merge_small(set, n, non_unique));
+
     const int64_t chunk = (n + set->merge_workers - 1) / set->merge_workers;
     int64_t start = tid * chunk;
     int64_t end = (tid + 1) * chunk;
@@ -234,86 +855,307 @@ int merge_hashset_parallel(HashSet* set, int tid) {
 
     int bi = 0;
 
-    uint64_t* restrict tmp = (uint64_t*)set->combined;
+    uint64_t* restrict tmp = set->combined;
     uint64_t* restrict hash_items = set->hash_items;
 
-    for (int shift = 32; shift < 64; shift += 8) {
-        const int odd = shift & 8;
-        uint64_t* restrict src = odd ? tmp : hash_items;
-        uint64_t* restrict dst = odd ? hash_items : tmp;
-
-        for (uint32_t i = start; i < end; i++)
-            bucket[(src[i] >> shift) & 0xFF]++;
-
+    int local_dups = 0;
+    const bool stream = n >= RADIX_STREAM_MIN_ROWS;
+
+    // Sets filled only through result_container_add_lazy_unique cannot contain
+    // duplicates, so they skip straight to the score passes. The others make a
+    // single pass over memory: equal hashes share their low byte, so each of
+    // the 256 partitions it spreads the rows over is deduped on its own.
+    // Hashes of small indices still differ there, unlike in their top byte.
+    if (non_unique) {
+        radix_histogram(hash_items, start, end, 32, 0, bucket);
         parallel_prefix_sum(set, tid, bucket, &bi);
+        radix_scatter64(hash_items, tmp, start, end, 32, 0, bucket, stream);
 
-        for (uint32_t i = start; i < end; i++)
-            dst[bucket[(src[i] >> shift) & 0xFF]++] = src[i];
+        barrier_wait(set, &bi);
+
+        // set->counts stays untouched until the next prefix sum
+        uint32_t from = 0;
+        for (int p = 0; p < 256; p++) {
+            uint32_t to = from;
+            for (int t = 0; t < set->merge_workers; t++)
+                to += set->counts[t][p];
+            if (p % set->merge_workers == tid) local_dups += dedup_partition(set, from, to);
+            from = to;
+        }
 
         barrier_wait(set, &bi);
         memset(bucket, 0, sizeof(bucket));
     }
 
-    int local_dups = 0;
+    uint32_t* restrict dest;
+
+    if (set->top_k > 0 && n > set->top_k) {
+        // Top-K: the histogram of the high score byte picks the threshold that
+        // covers the first top_k rows. Only the buckets above it are scattered
+        // and get their low byte sorted now, the rest waits for bucket_tail().
+        dest = (uint32_t*)set->hash_items;
+        const int blocks = atomic_load_explicit(&set->flush_blocks, memory_order_relaxed);
+
+        if (!non_unique && blocks <= MAX_FLUSH_BLOCKS) {
+            // The shards already wrote the keys and counted each flush past
+            // the first top_k rows. The blocks tile [0, n), so this worker sums
+            // those inside its range and only counts the rows of the two it
+            // shares with a neighbour and of the uncounted ones at the start.
+            for (int k = 0; k < blocks; k++) {
+                const uint32_t from = MAX(set->blocks[k].start, start);
+                const uint32_t to = MIN(set->blocks[k].start + set->blocks[k].size, end);
+                if (from >= to) continue;
+
+                if (to - from == set->blocks[k].size && set->blocks[k].counted) {
+                    const uint16_t* counts = set->blocks[k].counts;
+                    for (int b = 0; b < 256; b++)
+                        bucket[b] += counts[b];
+                } else {
+                    radix_histogram(tmp, from, to, 40, 0xFF, bucket);
+                }
+            }
+        } else {
+            for (uint32_t i = start; i < end; i++) {
+                const uint64_t key = item_key(set, hash_items[i]);
+                tmp[i] = (key << 32) | (hash_items[i] & 0xFFFFFFFFULL);
+                bucket[255 - (key >> 8)]++;
+            }
+        }
 
-    while (0 < start && start < n && (hash_items[start] >> 32) == (hash_items[start - 1] >> 32))
-        start++;
+        // Rows below the threshold byte land in the tail in whatever order
+        // they come, only the few above it are scattered to their buckets.
+        uint32_t tail;
+        const int threshold = split_top_k(set, tid, bucket, &tail, &bi);
+        for (uint32_t i = start; i < end; i++) {
+            const int b = 255 - (tmp[i] >> 40);
+            dest[b <= threshold ? bucket[b]++ : tail++] = (uint32_t)tmp[i];
+        }
 
-    while (end < n && (hash_items[end] >> 32) == (hash_items[end - 1] >> 32))
-        end++;
+        if (!barrier_check_last(set, &bi)) {
+            if (local_dups) atomic_fetch_sub_explicit(&set->size, local_dups, memory_order_release);
+            return 0;
+        }
 
-    for (uint32_t i = start + 1; i < end; i++) {
-        const uint64_t a = hash_items[i - 1];
-        const uint64_t b = hash_items[i];
-        if ((a >> 32) == (b >> 32)) {
-            hash_items[i - 1] &= ~0xFFFFFFFFULL; // set score to 0 so the items will appear last
-            if (b < a) hash_items[i] = a; // move the highest scoring candidate forwards.
-            local_dups++;
+        set->score_items = dest;
+        set->matches = (BobLauncherMatch**)set->combined;
+
+        // set->counts still holds every worker's histogram of the high byte
+        uint32_t bucket_end = 0;
+        for (int b = 0; b < 256; b++) {
+            if (b <= threshold)
+                for (int t = 0; t < set->merge_workers; t++)
+                    bucket_end += set->counts[t][b];
+            set->bucket_end[b] = bucket_end;
+        }
+        set->head_end = bucket_end;
+        hashset_sort_until(set, set->top_k - 1);
+    } else {
+        // Replace the hash with the sort key: score + 1, or 0 for duplicates so they sort last.
+        for (uint32_t i = start; i < end; i++) {
+            const uint64_t key = item_key(set, hash_items[i]);
+            tmp[i] = (key << 32) | (hash_items[i] & 0xFFFFFFFFULL);
+            bucket[255 - (key & 0xFF)]++;
+        }
+
+        parallel_prefix_sum(set, tid, bucket, &bi);
+        radix_scatter64(tmp, hash_items, start, end, 32, 0xFF, bucket, stream);
+
+        barrier_wait(set, &bi);
+        memset(bucket, 0, sizeof(bucket));
+
+        radix_histogram(hash_items, start, end, 40, 0xFF, bucket);
+        parallel_prefix_sum(set, tid, bucket, &bi);
+
+        dest = (uint32_t*)set->combined;
+        radix_scatter32(hash_items, dest, start, end, 40, 0xFF, bucket, stream);
+
+        if (!barrier_check_last(set, &bi)) {
+            if (local_dups) atomic_fetch_sub_explicit(&set->size, local_dups, memory_order_release);
+            return 0;
         }
+
+        set->score_items = dest;
+        set->matches = (BobLauncherMatch**)set->hash_items;
+        set->sorted_upto = n;
+        set->head_end = n;
     }
 
-    for (uint32_t i = start; i < end; i++)
-        bucket[255 - ((hash_items[i] >> 16) & 0xFE)]++;
+    return merge_done(set, n, local_dups);
+}
+
+#define CALIBRATION_MAX_ROWS 16384
+// Round trips sampled, CALIBRATION_TRIP_GAP_MS apart
+#define CALIBRATION_TRIPS 32
+#define CALIBRATION_TRIP_GAP_MS 10
 
-    parallel_prefix_sum(set, tid, bucket, &bi);
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// The two score byte passes a single merge worker makes over its rows
+static void radix_keys(uint64_t* restrict keys, uint64_t* restrict out, int64_t n) {
+    for (int shift = 32; shift < 48; shift += 8) {
+        uint32_t bucket[256] = {0};
+        for (int64_t i = 0; i < n; i++)
+            bucket[255 - ((keys[i] >> shift) & 0xFF)]++;
+
+        uint32_t sum = 0;
+        for (int b = 0; b < 256; b++) {
+            const uint32_t c = bucket[b];
+            bucket[b] = sum;
+            sum += c;
+        }
 
-    uint32_t* restrict score_tmp = set->combined + n;
+        for (int64_t i = 0; i < n; i++)
+            out[bucket[255 - ((keys[i] >> shift) & 0xFF)]++] = keys[i];
 
-    for (uint32_t i = start; i < end; i++)
-        score_tmp[bucket[255 - ((hash_items[i] >> 16) & 0xFE)]++] = (uint32_t)hash_items[i];
+        uint64_t* t = keys;
+        keys = out;
+        out = t;
+    }
+}
 
-    barrier_wait(set, &bi);
-    memset(bucket, 0, sizeof(bucket));
+static void calibration_ping(void* data) {
+    atomic_int* done = data;
+    atomic_store_explicit(done, 1, memory_order_release);
+    syscall(SYS_futex, done, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
 
-    for (uint32_t i = start; i < end; i++)
-        bucket[255 - ((score_tmp[i] >> 24) & 0xFF)]++;
+// Times both single worker sorts on synthetic keys to find where the radix
+// passes overtake a comparison sort, and a thread pool round trip to find how
+// many rows a merge worker has to take over before it pays for itself. Runs
+// on its own thread, the pool only ever gets the empty pings. A ping queued
+// behind a search is slow, so the round trip is the fastest of samples spread
+// over a third of a second, and the grain it gives is capped at
+// HASHSET_MAX_MERGE_GRAIN.
+void hashset_calibrate_merge(void* data) {
+    (void)data;
+    uint64_t* keys = malloc(3 * CALIBRATION_MAX_ROWS * sizeof(uint64_t));
+    if (!keys) return;
+    uint64_t* work = keys + CALIBRATION_MAX_ROWS;
+    uint64_t* out = work + CALIBRATION_MAX_ROWS;
+
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    for (int i = 0; i < CALIBRATION_MAX_ROWS; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        keys[i] = ((state & 0xFFFF) << 32) | i;
+    }
 
-    parallel_prefix_sum(set, tid, bucket, &bi);
+    int small = 0;
+    bool sorting = true;
+    double row_ns = 0;
+    for (int64_t n = 64; n <= CALIBRATION_MAX_ROWS; n *= 2) {
+        uint64_t sort_ns = UINT64_MAX, radix_ns = UINT64_MAX;
+        for (int run = 0; run < 5; run++) {
+            if (sorting) {
+                memcpy(work, keys, n * sizeof(uint64_t));
+                const uint64_t t0 = now_ns();
+                sort_keys(work, n);
+                sort_ns = MIN(sort_ns, now_ns() - t0);
+            }
 
-    uint32_t* restrict dest = set->combined;
+            memcpy(work, keys, n * sizeof(uint64_t));
+            const uint64_t t0 = now_ns();
+            radix_keys(work, out, n);
+            radix_ns = MIN(radix_ns, now_ns() - t0);
+        }
 
-    for (uint32_t i = start; i < end; i++)
-        dest[bucket[255 - ((score_tmp[i] >> 24) & 0xFF)]++] = score_tmp[i];
+        // the first size the radix passes win at ends the comparison sorts
+        if (sorting && sort_ns <= radix_ns) small = n;
+        else sorting = false;
+        row_ns = (double)radix_ns / n;
+    }
+    free(keys);
+
+    int grain = HASHSET_DEFAULT_MERGE_GRAIN;
+    if (hashset_merge_threads > 1 && row_ns > 0) {
+        uint64_t trip_ns = UINT64_MAX;
+        for (int run = 0; run < CALIBRATION_TRIPS; run++) {
+            if (run) nanosleep(&(struct timespec){ .tv_nsec = CALIBRATION_TRIP_GAP_MS * 1000000 }, NULL);
+
+            atomic_int done = 0;
+            const uint64_t t0 = now_ns();
+            thread_pool_run(calibration_ping, &done, NULL);
+            while (!atomic_load_explicit(&done, memory_order_acquire))
+                syscall(SYS_futex, &done, FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0);
+            trip_ns = MIN(trip_ns, now_ns() - t0);
+        }
 
-    if (barrier_check_last(set, &bi)) {
-        set->score_items = dest;
-        set->matches = (BobLauncherMatch**)(set->combined + n);
-        atomic_fetch_add_explicit(&set->size, n - local_dups - INITIAL_UNFINISHED, memory_order_release);
-        return 1;
-    } else if (local_dups) {
-        atomic_fetch_sub_explicit(&set->size, local_dups, memory_order_release);
+        // a worker is handed its task, then meets the others at two barriers
+        const double rows = 3 * trip_ns / row_ns;
+        grain = rows < small + 1 ? small + 1 :
+                rows > HASHSET_MAX_MERGE_GRAIN ? HASHSET_MAX_MERGE_GRAIN : (int)rows;
     }
-    return 0;
+
+    atomic_store_explicit(&hashset_small_merge, small, memory_order_relaxed);
+    atomic_store_explicit(&hashset_merge_grain, grain, memory_order_relaxed);
 }
 
 void container_return_sheet(HashSet* set, ResultContainer* container) {
     if (!container->current_sheet || container->current_sheet->size >= SHEET_SIZE) return;
 
     int pos = atomic_fetch_add(&set->write, 1);
+    if (pos >= UNFINISHED_QUEUE_SIZE - 1) return; // keep the NULL terminator
     set->unfinished_queue[pos] = container->current_sheet;
     container->current_sheet = NULL;
 }
 
+// hash_size counts reserved slots and flushed the copies that have landed.
+// Every flushed copy was reserved first, so once the two agree every slot
+// below them is written. Shards flush a sheet at a time, that happens often.
+static int settled_size(HashSet* set) {
+    for (int attempt = 0; attempt < 64; attempt++) {
+        const int flushed = atomic_load_explicit(&set->flushed, memory_order_acquire);
+        if (flushed == atomic_load_explicit(&set->hash_size, memory_order_relaxed)) return flushed;
+        __builtin_ia32_pause();
+    }
+    return -1;
+}
+
+HashSet* hashset_snapshot(HashSet* set) {
+    int taken = atomic_load(&set->previewed);
+    if (taken < 0) return NULL;
+
+    const int n = settled_size(set);
+    if (n <= taken) return NULL;
+    if (!atomic_compare_exchange_strong(&set->previewed, &taken, -1)) return NULL;
+
+    HashSet* snapshot = hashset_create(set->event_id);
+    if (snapshot) memcpy(snapshot->hash_items, set->hash_items, n * sizeof(uint64_t));
+    atomic_store(&set->previewed, snapshot ? n : taken);
+    if (!snapshot) return NULL;
+
+    atomic_store(&snapshot->hash_size, n);
+    atomic_store(&snapshot->non_unique, atomic_load(&set->non_unique));
+    // the keys and blocks were not copied, the snapshot sorts without them
+    atomic_store(&snapshot->flush_blocks, MAX_FLUSH_BLOCKS + 1);
+
+    // global_index_counter stays 0, the sheets are released by their owner
+    snapshot->own_sheets = snapshot->sheet_pool;
+    snapshot->sheet_pool = set->sheet_pool;
+    snapshot->source = hashset_ref(set);
+    merge_hashset_parallel(snapshot, 0);
+    return snapshot;
+}
+
+// The merge sorts hash_items in place, a snapshot still copying them has to
+// finish first and no new one may start.
+void hashset_seal(HashSet* set) {
+    int taken = atomic_load(&set->previewed);
+    for (;;) {
+        if (taken < 0) {
+            __builtin_ia32_pause();
+            taken = atomic_load(&set->previewed);
+        } else if (atomic_compare_exchange_weak(&set->previewed, &taken, INT_MAX)) {
+            return;
+        }
+    }
+}
+
 #define FOURTY_THREE_BITS 0x000007FFFFFFFFFFULL
 #define FOURTY_EIGHT_BITS 0x0000FFFFFFFFFFFFULL
 
@@ -322,6 +1164,7 @@ void container_return_sheet(HashSet* set, ResultContainer* container) {
 
 BobLauncherMatch* hashset_get_match_at(HashSet* set, int index) {
     if (atomic_load(&set->size) <= index) return NULL;
+    if (index >= set->sorted_upto) hashset_sort_until(set, index);
 
     uint32_t packed = set->score_items[index];
     if (packed != UINT32_MAX) {
@@ -339,11 +1182,61 @@ BobLauncherMatch* hashset_get_match_at(HashSet* set, int index) {
     return set->matches[index];
 }
 
+HashSet* hashset_ref(HashSet* set) {
+    atomic_fetch_add(&set->refs, 1);
+    return set;
+}
+
+static void free_hashset(HashSet* set) {
+    // pooled sets keep the sheets of earlier, larger searches around
+    for (int i = 0; i < set->touched_sheets; i++) {
+        free(set->sheet_pool[i]);
+    }
+    free(set->sheet_pool);
+    release_blocks(set->blocks);
+    release_items(set->combined);
+    release_items(set->hash_items);
+    free(set->counts);
+    free(set);
+}
+
+static gboolean pool_idle_trim(gpointer user_data) {
+    const int64_t idle = g_get_monotonic_time() - atomic_load_explicit(&pool_last_use, memory_order_relaxed);
+    if (idle < (int64_t)POOL_IDLE_SECONDS * G_USEC_PER_SEC) return G_SOURCE_CONTINUE;
+
+    HashSet* kept[POOL_IDLE_KEEP];
+    int n = 0;
+    HashSet* set;
+    while ((set = grab_hashset_from_pool())) {
+        if (n < POOL_IDLE_KEEP) {
+            trim_hashset(set, POOL_CLASS_MIN_ROWS);
+            kept[n++] = set;
+        } else {
+            free_hashset(set);
+        }
+    }
+
+    while (n > 0) {
+        set = kept[--n];
+        if (!return_hashset_to_pool(set)) free_hashset(set);
+    }
+
+    atomic_store(&pool_demand, 0);
+    atomic_store(&pool_idle_pending, false);
+    return G_SOURCE_REMOVE;
+}
+
+static void schedule_idle_trim(void) {
+    if (atomic_exchange(&pool_idle_pending, true)) return;
+    g_timeout_add_seconds(POOL_IDLE_SECONDS, pool_idle_trim, NULL);
+}
+
 void hashset_destroy(HashSet* set) {
     if (!set) return;
+    if (atomic_fetch_sub(&set->refs, 1) != 1) return;
 
     int old_capacity = atomic_exchange(&set->size, -1);
-    int num_sheets = atomic_load(&set->global_index_counter);
+    int num_sheets = MIN(atomic_load(&set->global_index_counter), MAX_SHEETS);
 
     for (int i = 0; i < num_sheets; i++) {
         ResultSheet* sheet = set->sheet_pool[i];
@@ -364,17 +1257,130 @@ void hashset_destroy(HashSet* set) {
         }
     }
 
+    // the matches above were made from its sheets, so the source goes last
+    HashSet* source = set->source;
+    if (source) {
+        set->sheet_pool = set->own_sheets;
+        set->source = NULL;
+    }
+
+    // snapshots say nothing about how large searches get
+    if (!source) note_demand(atomic_load(&set->hash_size));
     reset_hashset(set);
+    trim_hashset(set, pool_class(atomic_load_explicit(&pool_demand, memory_order_relaxed)));
+
     if (return_hashset_to_pool(set)) {
+        schedule_idle_trim();
+    } else {
+        free_hashset(set);
+    }
+    hashset_destroy(source);
+}
+
+typedef struct {
+    HashSet* set;
+    char* query;
+    int pane;
+    CacheProvider* providers;
+    int provider_count;
+    uint64_t last_used;
+} CacheEntry;
+
+static CacheEntry result_cache[HASHSET_CACHE_SIZE];
+static uint64_t cache_clock = 0;
+
+static bool same_providers(const CacheEntry* e, const CacheProvider* providers, int count) {
+    if (e->provider_count != count) return false;
+    for (int i = 0; i < count; i++) {
+        if (e->providers[i].provider != providers[i].provider ||
+            e->providers[i].generation != providers[i].generation)
+            return false;
+    }
+    return true;
+}
+
+static CacheEntry* cache_find(int pane, const CacheProvider* providers, int count, const char* query) {
+    for (int i = 0; i < HASHSET_CACHE_SIZE; i++) {
+        CacheEntry* e = &result_cache[i];
+        if (e->set && e->pane == pane && same_providers(e, providers, count) && strcmp(e->query, query) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+static void cache_evict(CacheEntry* e) {
+    if (!e->set) return;
+    thread_pool_run((TaskFunc)hashset_destroy, e->set, NULL);
+    free(e->query);
+    free(e->providers);
+    e->set = NULL;
+    e->query = NULL;
+    e->providers = NULL;
+    e->provider_count = 0;
+}
+
+// Sets searched before one of these providers changed its contents
+static void cache_evict_stale(const CacheProvider* providers, int count) {
+    for (int i = 0; i < HASHSET_CACHE_SIZE; i++) {
+        CacheEntry* e = &result_cache[i];
+        for (int k = 0; e->set && k < e->provider_count; k++) {
+            for (int p = 0; p < count; p++) {
+                if (e->providers[k].provider == providers[p].provider &&
+                    e->providers[k].generation != providers[p].generation) {
+                    cache_evict(e);
+                    break;
+                }
+            }
+        }
+    }
+}
+
+// The caller owns the returned reference
+HashSet* hashset_cache_lookup(int pane, const CacheProvider* providers, int count, const char* query) {
+    cache_evict_stale(providers, count);
+
+    CacheEntry* e = cache_find(pane, providers, count, query);
+    if (!e) return NULL;
+
+    e->last_used = ++cache_clock;
+    return hashset_ref(e->set);
+}
+
+void hashset_cache_insert(int pane, const CacheProvider* providers, int count, const char* query, HashSet* set) {
+    CacheEntry* e = cache_find(pane, providers, count, query);
+    if (e && e->set == set) {
+        e->last_used = ++cache_clock;
         return;
     }
 
-    for (int i = 0; i < num_sheets; i++) {
-        free(set->sheet_pool[i]);
+    if (!e) {
+        e = &result_cache[0];
+        for (int i = 1; i < HASHSET_CACHE_SIZE && e->set; i++) {
+            if (!result_cache[i].set || result_cache[i].last_used < e->last_used)
+                e = &result_cache[i];
+        }
     }
-    free(set->sheet_pool);
-    free(set->combined);
-    free(set->hash_items);
-    free(set->counts);
-    free(set);
+
+    cache_evict(e);
+
+    e->query = strdup(query);
+    e->providers = malloc(MAX(count, 1) * sizeof(CacheProvider));
+    if (!e->query || !e->providers) {
+        free(e->query);
+        free(e->providers);
+        e->query = NULL;
+        e->providers = NULL;
+        return;
+    }
+    memcpy(e->providers, providers, count * sizeof(CacheProvider));
+
+    e->set = hashset_ref(set);
+    e->pane = pane;
+    e->provider_count = count;
+    e->last_used = ++cache_clock;
+}
+
+void hashset_cache_clear(void) {
+    for (int i = 0; i < HASHSET_CACHE_SIZE; i++)
+        cache_evict(&result_cache[i]);
 }
@@ -15,21 +15,41 @@ typedef void (*TaskFunc)(void *data);
 #define CACHELINE 64
 #define PAD(sz) ((CACHELINE - ((sz) % CACHELINE)) % CACHELINE)
 
+// Rows that are fully ordered when a merge completes, 0 orders all of them
+#define HASHSET_DEFAULT_TOP_K 64
+
+// Merged sets kept around for queries the user is likely to return to
+#define HASHSET_CACHE_SIZE 8
+
+// Merge thresholds until hashset_calibrate_merge() has measured this machine:
+// sets up to SMALL_MERGE rows are sorted by comparison on a single worker,
+// and every further worker needs MERGE_GRAIN rows to pay for its barriers.
+#define HASHSET_DEFAULT_SMALL_MERGE 1024
+#define HASHSET_DEFAULT_MERGE_GRAIN 16384
+// A slow measurement never keeps large sets on fewer workers than this implies
+#define HASHSET_MAX_MERGE_GRAIN (16 * HASHSET_DEFAULT_MERGE_GRAIN)
+
 extern int hashset_merge_threads;
+extern int hashset_top_k;
+// Written once calibration is done, while searches may already be merging
+extern atomic_int hashset_small_merge;
+extern atomic_int hashset_merge_grain;
 void hashset_init(int num_workers);
+void hashset_set_top_k(int top_k);
+void hashset_calibrate_merge(void* data);
 
 typedef struct {
     atomic_int v;
     char _pad[PAD(sizeof(atomic_int))];
 } padded_atomic_int;
 
-typedef struct {
+typedef struct HashSet {
     // === CACHE LINE 1 ===
     atomic_int hash_size;
     int event_id;
     int merge_workers;
     uint64_t* hash_items;
-    uint32_t* combined;
+    uint64_t* combined;
     BobLauncherMatch** matches;
     uint32_t* score_items;
     atomic_int size;
@@ -43,18 +63,59 @@ typedef struct {
     ResultSheet** sheet_pool;
     _Atomic(ResultSheet**) read;
     atomic_int global_index_counter;
-    ResultSheet* unfinished_queue[MAX_SHEETS];
+    atomic_int dropped;
+    atomic_int non_unique;
+    atomic_int refs;
+    atomic_int prune_threshold;  // stored score the top_k rows are known to reach
+    atomic_int flushed;          // hash_items whose copy has landed, see container_flush_items()
+    atomic_int previewed;        // hash_items covered by the last snapshot, -1 while one is taken
+    atomic_int publishing;       // a snapshot of this set is on its way to the UI
+    atomic_int flush_blocks;
+    FlushBlock* blocks;
+    int top_k;
+    int sorted_upto;
+    int head_end;                // rows past it are bucketed on first use, see bucket_tail()
+    int touched;                 // rows of hash_items and combined that may be backed, see trim_hashset()
+    int touched_blocks;
+    int touched_sheets;          // sheet_pool slots ever handed out, a failed malloc leaves a hole
+    struct HashSet* source;      // a snapshot borrows the sheets of this set
+    ResultSheet** own_sheets;
+    uint32_t bucket_end[256];
+    ResultSheet* unfinished_queue[UNFINISHED_QUEUE_SIZE];
 } HashSet;
 
 HashSet* hashset_create(int event_id);
+HashSet* hashset_ref(HashSet* set);
 void hashset_destroy(HashSet* set);
 
+// A provider a cached set was searched with, and the generation of its
+// contents at the time
+typedef struct {
+    const void* provider;
+    int generation;
+} CacheProvider;
+
+// The cache is only touched from the main thread. A lookup only returns a set
+// searched with exactly these providers, and evicts every set that a provider
+// in the list has a newer generation for.
+HashSet* hashset_cache_lookup(int pane, const CacheProvider* providers, int count, const char* query);
+void hashset_cache_insert(int pane, const CacheProvider* providers, int count, const char* query, HashSet* set);
+void hashset_cache_clear(void);
+
 void container_return_sheet(HashSet* set, ResultContainer* container);
 void hashset_merge_new(HashSet* set, ResultContainer* current);
 void hashset_prepare(HashSet* hashset);
 void hashset_prepare_new(HashSet* hashset);
 
 int merge_hashset_parallel(HashSet* set, int tid);
+#define hashset_merged(set) (atomic_load(&(set)->size) >= 0)
+
+// A merged set of what the shards of a running search have flushed so far,
+// sharing its sheets. NULL while nothing new can be taken.
+HashSet* hashset_snapshot(HashSet* set);
+void hashset_seal(HashSet* set);
+// Lowers merge_workers to what the finished set is worth and returns it
+int hashset_plan_merge(HashSet* set);
 #define hashset_prepare_new(set) merge_hashset_parallel(set, 0)
 
 ResultContainer* hashset_create_handle(HashSet* hashset, const char* query, int16_t bonus, needle_info* string_info, needle_info* string_info_spaceless);
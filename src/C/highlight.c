@@ -115,42 +115,32 @@ void highlight_set_accent_color(const char* color) {
     highlight_format_accent_color(&accent_rgba);
 }
 
-// Get match positions
-int* match_positions_with_markup(needle_info* needle, const char* haystack, int* result_length) {
-    if (!needle || !haystack) return NULL;
-
-    int n = needle->len;
-    size_t len = (n + 1 < MATCH_MAX_LEN) ? n + 1 : MATCH_MAX_LEN;
-
-    int* positions = malloc(len * sizeof(int));
-    if (!positions) return NULL;
-
-    memset(positions, -1, len * sizeof(int));
-    match_positions(needle, haystack, positions);
-
-    *result_length = len;
-    return positions;
-}
-
 HighlightPositions* highlight_calculate_positions(needle_info* needle, const char* text) {
     if (!needle || !text) return NULL;
 
-    int positions_length = 0;
-    int* char_positions = match_positions_with_markup(needle, text, &positions_length);
-    if (!char_positions) return NULL;
-
     HighlightPositions* result = malloc(sizeof(HighlightPositions));
-    if (!result) {
-        free(char_positions);
-        return NULL;
-    }
+    if (!result) return NULL;
 
-    // Pre-allocate for worst case
-    result->byte_ranges = malloc(positions_length * 2 * sizeof(size_t));
+    result->byte_ranges = NULL;
     result->range_count = 0;
 
+    // Positions and ranges live on the stack; the DP rows come from the
+    // thread's match scratch, so a row update only allocates the result.
+    // Longer needles cannot match within MATCH_MAX_LEN characters
+    int n = needle->len;
+    if (n == 0 || n > MATCH_MAX_LEN) return result;
+
+    // Left at -1 when the text does not match, in which case no DP is run.
+    // Multi-token needles come back sorted with -1 padding at the end.
+    int char_positions[n];
+    memset(char_positions, -1, sizeof(char_positions));
+    match_score_positions(needle, text, char_positions, NULL);
+    if (char_positions[0] < 0 && char_positions[n - 1] < 0) return result;
+
+    size_t ranges[n * 2];
+
     // Convert character positions to byte ranges
-    size_t pos_idx = 0;
+    int pos_idx = 0;
     int char_counter = 0;
     gboolean in_highlight = FALSE;
     size_t highlight_start_byte = 0;
@@ -158,7 +148,7 @@ HighlightPositions* highlight_calculate_positions(needle_info* needle, const cha
     const char* p = text;
     size_t byte_pos = 0;
 
-    while (*p && pos_idx < positions_length) {
+    while (*p && pos_idx < n) {
         uint32_t c;
         size_t char_len = get_next_utf8(p, &c);
         if (char_len == 0) break;
@@ -171,8 +161,8 @@ HighlightPositions* highlight_calculate_positions(needle_info* needle, const cha
             pos_idx++;
         } else if (in_highlight) {
             // Store the range
-            result->byte_ranges[result->range_count * 2] = highlight_start_byte;
-            result->byte_ranges[result->range_count * 2 + 1] = byte_pos;
+            ranges[result->range_count * 2] = highlight_start_byte;
+            ranges[result->range_count * 2 + 1] = byte_pos;
             result->range_count++;
             in_highlight = FALSE;
         }
@@ -184,20 +174,18 @@ HighlightPositions* highlight_calculate_positions(needle_info* needle, const cha
 
     // Handle case where highlight extends to end
     if (in_highlight) {
-        result->byte_ranges[result->range_count * 2] = highlight_start_byte;
-        result->byte_ranges[result->range_count * 2 + 1] = byte_pos;
+        ranges[result->range_count * 2] = highlight_start_byte;
+        ranges[result->range_count * 2 + 1] = byte_pos;
         result->range_count++;
     }
 
-    free(char_positions);
-
-    // Shrink to actual size
     if (result->range_count > 0) {
-        result->byte_ranges = realloc(result->byte_ranges,
-                                      result->range_count * 2 * sizeof(size_t));
-    } else {
-        free(result->byte_ranges);
-        result->byte_ranges = NULL;
+        result->byte_ranges = malloc(result->range_count * 2 * sizeof(size_t));
+        if (!result->byte_ranges) {
+            result->range_count = 0;
+            return result;
+        }
+        memcpy(result->byte_ranges, ranges, result->range_count * 2 * sizeof(size_t));
     }
 
     return result;
@@ -0,0 +1,256 @@
+#include "path-corpus.h"
+#include "events.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define LCP_MAX UINT16_MAX
+// haystack_update records a position for every byte it decodes
+#define INDEX_SIZE (MATCH_MAX_LEN * 4 + 1)
+
+PathCorpus* path_corpus_new(void) {
+    return calloc(1, sizeof(PathCorpus));
+}
+
+static void drop_pending(PathCorpus* corpus) {
+    for (int i = 0; i < corpus->pending_count; i++) free(corpus->pending[i].path);
+    free(corpus->pending);
+    corpus->pending = NULL;
+    corpus->pending_count = 0;
+    corpus->pending_capacity = 0;
+}
+
+void path_corpus_free(PathCorpus* corpus) {
+    if (!corpus) return;
+    drop_pending(corpus);
+    free(corpus->data);
+    free(corpus->offsets);
+    free(corpus->lcp);
+    free(corpus->ids);
+    free(corpus->signatures);
+    free(corpus);
+}
+
+int path_corpus_size(const PathCorpus* corpus) {
+    return corpus ? corpus->count : 0;
+}
+
+static void add_pending(PathCorpus* corpus, char* path, uint32_t id) {
+    if (corpus->pending_count == corpus->pending_capacity) {
+        int capacity = corpus->pending_capacity ? corpus->pending_capacity * 2 : 1024;
+        PathCorpusEntry* pending = realloc(corpus->pending, capacity * sizeof(PathCorpusEntry));
+        if (!pending) {
+            free(path);
+            return;
+        }
+        corpus->pending = pending;
+        corpus->pending_capacity = capacity;
+    }
+    corpus->pending[corpus->pending_count++] = (PathCorpusEntry){path, id};
+}
+
+void path_corpus_add(PathCorpus* corpus, const char* path, uint32_t id) {
+    if (!corpus || !path) return;
+    char* copy = strdup(path);
+    if (copy) add_pending(corpus, copy, id);
+}
+
+static inline int stored_from(const PathCorpus* corpus, int i) {
+    return i % PATH_CORPUS_RESTART ? corpus->lcp[i] : 0;
+}
+
+// Rebuilds entry i in buf, which holds entry i - 1 unless i is a restart point
+static inline int decode_entry(const PathCorpus* corpus, int i, char* buf) {
+    const int from = stored_from(corpus, i);
+    const char* stored = corpus->data + corpus->offsets[i];
+    const int len = strlen(stored);
+    memcpy(buf + from, stored, len + 1);
+    return from + len;
+}
+
+static int compare_entries(const void* a, const void* b) {
+    return strcmp(((const PathCorpusEntry*)a)->path, ((const PathCorpusEntry*)b)->path);
+}
+
+static int shared_prefix(const char* a, const char* b) {
+    int n = 0;
+    while (n < LCP_MAX && a[n] && a[n] == b[n]) n++;
+    // never split a character, decoding resumes at the shared length
+    while (n > 0 && ((unsigned char)b[n] & 0xC0) == 0x80) n--;
+    return n;
+}
+
+static void release_encoding(PathCorpus* corpus) {
+    free(corpus->data);
+    free(corpus->offsets);
+    free(corpus->lcp);
+    free(corpus->ids);
+    free(corpus->signatures);
+    corpus->data = NULL;
+    corpus->offsets = NULL;
+    corpus->lcp = NULL;
+    corpus->ids = NULL;
+    corpus->signatures = NULL;
+    corpus->count = 0;
+    corpus->max_len = 0;
+}
+
+void path_corpus_build(PathCorpus* corpus) {
+    if (!corpus) return;
+
+    // current entries go back through the sort with the new ones
+    if (corpus->count) {
+        char* buf = malloc(corpus->max_len + 1);
+        bool copied = buf != NULL;
+        for (int i = 0; copied && i < corpus->count; i++) {
+            decode_entry(corpus, i, buf);
+            char* path = strdup(buf);
+            copied = path != NULL;
+            if (copied) add_pending(corpus, path, corpus->ids[i]);
+        }
+        free(buf);
+        release_encoding(corpus);
+
+        // like the allocations below, a failed copy leaves the corpus empty
+        if (!copied) {
+            drop_pending(corpus);
+            return;
+        }
+    }
+
+    const int count = corpus->pending_count;
+    PathCorpusEntry* entries = corpus->pending;
+    qsort(entries, count, sizeof(PathCorpusEntry), compare_entries);
+
+    corpus->offsets = malloc((count + 1) * sizeof(uint32_t));
+    corpus->lcp = malloc((count + 1) * sizeof(uint16_t));
+    corpus->ids = malloc((count + 1) * sizeof(uint32_t));
+    corpus->signatures = malloc((count + 1) * sizeof(uint64_t));
+
+    size_t size = 0;
+    for (int i = 0; corpus->lcp && i < count; i++) {
+        corpus->lcp[i] = i ? shared_prefix(entries[i - 1].path, entries[i].path) : 0;
+        size += strlen(entries[i].path + stored_from(corpus, i)) + 1;
+    }
+    corpus->data = malloc(size ? size : 1);
+
+    if (!corpus->offsets || !corpus->lcp || !corpus->ids || !corpus->signatures || !corpus->data) {
+        release_encoding(corpus);
+    } else {
+        size_t offset = 0;
+        for (int i = 0; i < count; i++) {
+            const char* stored = entries[i].path + stored_from(corpus, i);
+            const size_t len = strlen(stored) + 1;
+            memcpy(corpus->data + offset, stored, len);
+            corpus->offsets[i] = offset;
+            corpus->ids[i] = entries[i].id;
+            corpus->signatures[i] = match_signature(entries[i].path);
+            offset += len;
+
+            const int path_len = strlen(entries[i].path);
+            if (path_len > corpus->max_len) corpus->max_len = path_len;
+        }
+        corpus->count = count;
+    }
+
+    drop_pending(corpus);
+}
+
+/*
+ * Continues the subsequence check from the shared prefix on raw bytes, so
+ * most paths are rejected without decoding their suffix. Anything past the
+ * first non-ASCII byte is left to haystack_update and its case tables.
+ */
+static int suffix_may_match(const needle_info* needle, const char* suffix, int matched) {
+    const uint8_t* s = (const uint8_t*)suffix;
+    for (; matched < needle->len && *s; s++) {
+        if (*s >= 0x80) return 1;
+        if (*s == needle->chars[matched] || *s == needle->unicode_upper[matched]) matched++;
+    }
+    return matched == needle->len;
+}
+
+static void search_plain(const PathCorpus* corpus, ResultContainer* rc, int from, int to, char* buf,
+                         PathCorpusMatch on_match, void* user_data) {
+    for (int i = from; i < to; i++) {
+        if ((i & 255) == 0 && result_container_is_cancelled(rc)) return;
+        decode_entry(corpus, i, buf);
+        if (!result_container_has_match_signed(rc, buf, corpus->signatures[i])) continue;
+
+        const int32_t score = result_container_match_score_pruned(rc, buf);
+        if (score > SCORE_BELOW_THRESHOLD) on_match(corpus->ids[i], buf, score, user_data);
+    }
+}
+
+void path_corpus_search(const PathCorpus* corpus, ResultContainer* rc, int from, int to,
+                        PathCorpusMatch on_match, void* user_data) {
+    if (!corpus || !rc || !on_match) return;
+    if (from < 0) from = 0;
+    if (to > corpus->count) to = corpus->count;
+    if (from >= to) return;
+
+    const needle_info* needle = rc->string_info;
+    char* buf = malloc(corpus->max_len + 1);
+    if (!buf) return;
+
+    // bring buf up to the entry before `from`
+    for (int i = from - from % PATH_CORPUS_RESTART; i < from; i++) decode_entry(corpus, i, buf);
+
+    const int n = needle->len;
+    if (n == 0 || n > PATH_CORPUS_MAX_NEEDLE || needle->tokenized || needle->typo_max) {
+        search_plain(corpus, rc, from, to, buf, on_match, user_data);
+        free(buf);
+        return;
+    }
+
+    haystack_info* hay = malloc(sizeof(haystack_info));
+    haystack_index* index = malloc(INDEX_SIZE * sizeof(haystack_index));
+    CacheCell* cache = malloc((size_t)MATCH_MAX_LEN * n * sizeof(CacheCell));
+    if (!hay || !index || !cache) {
+        search_plain(corpus, rc, from, to, buf, on_match, user_data);
+        goto out;
+    }
+
+    index[0] = (haystack_index){0, 0};
+    int indexed = 0;     // bytes of buf that index[] and hay describe
+    int valid_cols = 0;  // cache columns that hold the DP of the current prefix
+
+    for (int i = from; i < to; i++) {
+        if ((i & 255) == 0 && result_container_is_cancelled(rc)) break;
+        const int len = decode_entry(corpus, i, buf);
+
+        // positions and subsequence state of the previous path hold up to the shared prefix
+        const int common = i == from ? 0 : corpus->lcp[i] < indexed ? corpus->lcp[i] : indexed;
+        const int start = index[common].pos;
+        if (start < valid_cols) valid_cols = start;
+        indexed = common;
+
+        if (!result_container_may_match(rc, corpus->signatures[i])) continue;
+        if (!suffix_may_match(needle, buf + common, index[common].n_idx)) continue;
+
+        // as with match_score_pruned; the cached columns just stop at the shared prefix
+        int32_t bound;
+        if (result_container_prune(rc, buf, &bound)) {
+            if (bound > SCORE_BELOW_THRESHOLD) on_match(corpus->ids[i], buf, bound, user_data);
+            continue;
+        }
+
+        const int matched = haystack_update(hay, buf, common, index, needle);
+        indexed = hay->len < MATCH_MAX_LEN ? len : 0;
+        if (!matched) continue;
+
+        score_t score;
+        if (n < hay->len) {
+            score = match_score_column_major(needle, hay, valid_cols, cache);
+            valid_cols = hay->len;
+        } else {
+            score = match_score_column_major(needle, hay, 0, cache);
+        }
+        on_match(corpus->ids[i], buf, score, user_data);
+    }
+
+out:
+    free(cache);
+    free(index);
+    free(hay);
+    free(buf);
+}
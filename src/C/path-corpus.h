@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+#include "result-container.h"
+
+// Every this many entries a path is stored whole, so a scan can start there
+#define PATH_CORPUS_RESTART 64
+// Longer needles score every path on its own rather than keep that many DP columns
+#define PATH_CORPUS_MAX_NEEDLE 64
+
+typedef struct {
+    char* path;
+    uint32_t id;
+} PathCorpusEntry;
+
+/*
+ * Paths sorted bytewise and front-coded: each entry stores the bytes after
+ * the prefix it shares with the previous path, except at restart points
+ * where the whole path is kept. lcp[] always holds the real shared prefix,
+ * cut back to a UTF-8 character boundary, so a scan can resume the DP of
+ * the previous path from the first differing column even across restarts.
+ */
+typedef struct {
+    char* data;
+    uint32_t* offsets;  // of each entry's stored bytes in data
+    uint16_t* lcp;
+    uint32_t* ids;  // caller ids in sorted order
+    uint64_t* signatures;  // see match_signature()
+    int count;
+    int max_len;
+
+    PathCorpusEntry* pending;  // added since the last build
+    int pending_count;
+    int pending_capacity;
+} PathCorpus;
+
+typedef void (*PathCorpusMatch)(uint32_t id, const char* path, int32_t score, void* user_data);
+
+PathCorpus* path_corpus_new(void);
+void path_corpus_free(PathCorpus* corpus);
+void path_corpus_add(PathCorpus* corpus, const char* path, uint32_t id);
+// Sorts and encodes everything added so far together with the current entries
+void path_corpus_build(PathCorpus* corpus);
+int path_corpus_size(const PathCorpus* corpus);
+
+/*
+ * Scores entries [from, to) against the container's needle and calls
+ * on_match with the reconstructed path for every match, in sorted order.
+ * Columns for the prefix shared with the previous path are not recomputed.
+ * Like result_container_match_score_pruned, paths that cannot reach the
+ * ordered top rows get an upper bound, so scores must be inserted unchanged.
+ */
+void path_corpus_search(const PathCorpus* corpus, ResultContainer* rc, int from, int to,
+                        PathCorpusMatch on_match, void* user_data);
@@ -5,6 +5,7 @@
 #include <thread-manager.h>
 #include <match.h>
 #include <match-row-label.h>
+#include <data-sink-sources.h>
 
 typedef struct _BobLauncherMatchRowPrivate BobLauncherMatchRowPrivate;
 struct _BobLauncherMatchRow {
@@ -142,6 +143,18 @@ bob_launcher_result_box_on_box_size_change(GSettings *settings, const gchar *key
     gtk_widget_queue_resize(GTK_WIDGET(self));
 }
 
+static void
+bob_launcher_result_box_on_merge_top_k_change(GSettings *settings, const gchar *key, gpointer user_data)
+{
+    hashset_set_top_k(g_settings_get_int(settings, "merge-top-k"));
+}
+
+static void
+bob_launcher_result_box_on_publish_interval_change(GSettings *settings, const gchar *key, gpointer user_data)
+{
+    data_sink_sources_set_publish_interval(g_settings_get_int(settings, "publish-interval"));
+}
+
 static void
 bob_launcher_result_box_initialize_slots(BobLauncherResultBox *self)
 {
@@ -365,6 +378,14 @@ bob_launcher_result_box_instance_init(BobLauncherResultBox *self, gpointer klass
     g_signal_connect(self->priv->ui_settings, "changed::box-size",
                      G_CALLBACK(bob_launcher_result_box_on_box_size_change), self);
 
+    hashset_set_top_k(g_settings_get_int(self->priv->ui_settings, "merge-top-k"));
+    g_signal_connect(self->priv->ui_settings, "changed::merge-top-k",
+                     G_CALLBACK(bob_launcher_result_box_on_merge_top_k_change), self);
+
+    data_sink_sources_set_publish_interval(g_settings_get_int(self->priv->ui_settings, "publish-interval"));
+    g_signal_connect(self->priv->ui_settings, "changed::publish-interval",
+                     G_CALLBACK(bob_launcher_result_box_on_publish_interval_change), self);
+
     bob_launcher_result_box_initialize_slots(self);
     bob_launcher_scroll_controller_setup(self);
 }
@@ -73,14 +73,18 @@ static inline bool grab_fresh_sheet(ResultContainer* container) {
         return false;
     }
 
-    ResultSheet* sheet = malloc(sizeof(ResultSheet));
+    // sheets outlive the HashSet they were handed out from when it is pooled
+    ResultSheet* sheet = container->sheet_pool[global_index];
     if (!sheet) {
-        return false;
+        sheet = malloc(sizeof(ResultSheet));
+        if (!sheet) {
+            return false;
+        }
+        container->sheet_pool[global_index] = sheet;
     }
 
     sheet->size = 0;
     sheet->global_index = global_index;
-    container->sheet_pool[global_index] = sheet;
     container->current_sheet = sheet;
     return true;
 }
@@ -102,6 +106,14 @@ void container_destroy(ResultContainer* container) {
     free(container->local_items);
     container->local_items = NULL;
 
+    free(container->candidates);
+    container->candidates = NULL;
+    free(container->top);
+    container->top = NULL;
+    free(container->rows.data);
+    free(container->rows.offsets);
+    container->rows = (CandidateRows){0};
+
     container->current_sheet = NULL;
     container->string_info = NULL;
     container->string_info_spaceless = NULL;
@@ -110,19 +122,213 @@ void container_destroy(ResultContainer* container) {
     free(container);
 }
 
+static void record_candidate(ResultContainer* container, uint32_t candidate, uint32_t row_offset) {
+    if (container->candidates_size == container->candidates_capacity) {
+        int capacity = container->candidates_capacity ? container->candidates_capacity * 2 : SHEET_SIZE;
+        uint32_t* grown = realloc(container->candidates, capacity * sizeof(uint32_t));
+        uint32_t* offsets = grown ? realloc(container->rows.offsets, capacity * sizeof(uint32_t)) : NULL;
+        if (grown) container->candidates = grown;
+        if (!offsets) {
+            // an incomplete list must never be refined, so stop recording altogether
+            container->record_candidates = false;
+            container->candidates_lost = true;
+            return;
+        }
+        container->rows.offsets = offsets;
+        container->candidates_capacity = capacity;
+    }
+
+    container->rows.offsets[container->candidates_size] = row_offset;
+    container->candidates[container->candidates_size++] = candidate;
+}
+
+void result_container_add_candidate(ResultContainer* container, uint32_t candidate) {
+    if (!container->record_candidates) return;
+    record_candidate(container, candidate, CANDIDATE_NO_ROW);
+}
+
+// Providers re-score their candidates in the order they were handed out,
+// so the lookup only ever moves forward; an id it cannot find gets no row.
+static const int16_t* previous_row(ResultContainer* container, uint32_t candidate) {
+    if (!container->previous_offsets) return NULL;
+
+    for (int i = container->previous_cursor; i < container->previous_count; i++) {
+        if (container->previous_ids[i] != candidate) continue;
+
+        container->previous_cursor = i + 1;
+        uint32_t offset = container->previous_offsets[i];
+        return offset == CANDIDATE_NO_ROW ? NULL : container->previous_rows + offset;
+    }
+    return NULL;
+}
+
+static int16_t* reserve_row(ResultContainer* container) {
+    CandidateRows* rows = &container->rows;
+    if (!container->record_candidates || container->string_info->len > MATCH_ROW_MAX_NEEDLE ||
+        container->string_info->tokenized)
+        return NULL;
+
+    size_t needed = rows->size + MATCH_ROW_SIZE(MATCH_MAX_LEN);
+    if (needed > CANDIDATE_ROWS_MAX) return NULL;
+
+    if (needed > rows->capacity) {
+        size_t capacity = rows->capacity ? rows->capacity * 2 : 4 * MATCH_ROW_SIZE(MATCH_MAX_LEN);
+        while (capacity < needed) capacity *= 2;
+
+        int16_t* grown = realloc(rows->data, capacity * sizeof(int16_t));
+        if (!grown) return NULL;
+        rows->data = grown;
+        rows->capacity = capacity;
+    }
+    return rows->data + rows->size;
+}
+
+bool result_container_match_candidate(ResultContainer* container, uint32_t candidate, const char* haystack, int32_t* score) {
+    const int16_t* last = previous_row(container, candidate);
+    int16_t* row = reserve_row(container);
+
+    if (!match_score_extend(container->string_info, haystack, last, container->previous_needle_len, row, score))
+        return false;
+
+    if (container->record_candidates) {
+        uint32_t offset = CANDIDATE_NO_ROW;
+        if (row) {
+            offset = container->rows.size;
+            container->rows.size += MATCH_ROW_SIZE(row[0]);
+        }
+        record_candidate(container, candidate, offset);
+    }
+    return true;
+}
+
+// Sort keys as merge_hashset_parallel builds them: score + 1 above the item index
+static void record_flush(ResultContainer* container, int write_start) {
+    const int block = atomic_fetch_add_explicit(container->global_blocks_size, 1, memory_order_relaxed);
+    if (block >= MAX_FLUSH_BLOCKS) return;
+
+    FlushBlock* restrict b = &container->global_blocks[block];
+    uint64_t* restrict keys = container->global_keys + write_start;
+    b->start = write_start;
+    b->size = container->local_items_size;
+    b->counted = write_start + container->local_items_size > (size_t)container->count_from;
+    if (b->counted) memset(b->counts, 0, sizeof(b->counts));
+
+    for (size_t i = 0; i < container->local_items_size; i++) {
+        const uint64_t item = container->local_items[i];
+        const uint64_t key = container->sheet_pool[SHEET_IDX(item)]->scores[ITEM_IDX(item)] + 1;
+        keys[i] = (key << 32) | (item & 0xFFFFFFFFULL);
+        if (b->counted) b->counts[255 - (key >> 8)]++;
+    }
+}
+
 void container_flush_items(ResultContainer* container) {
     if (!container || !container->local_items_size) return;
 
+    if (container->non_unique) {
+        atomic_store_explicit(container->global_non_unique, 1, memory_order_relaxed);
+    }
+
     int write_start = atomic_fetch_add_explicit(container->global_items_size, container->local_items_size, memory_order_relaxed);
 
     memcpy(container->global_items + write_start, container->local_items, container->local_items_size * sizeof(uint64_t));
+    // sets with duplicates are sorted by hash first, their keys come later
+    if (!container->non_unique) record_flush(container, write_start);
+    atomic_fetch_add_explicit(container->global_items_flushed, container->local_items_size, memory_order_release);
     container->local_items_size = 0;
 }
 
-static inline uint32_t hash_from_pointers(const void* p1, const void* p2, const void* p3, uint16_t high_bits) {
-    const void* ptrs[] = { p1, p2, p3 };
-    uint32_t hash = XXH32(ptrs, sizeof(ptrs), high_bits);  // Use as seed for better mixing
-    return ((uint32_t)high_bits << 16) | (hash & 0xFFFF);
+// murmur3 finalizer. It is a bijection, so unique items can never collide with each other.
+static inline uint32_t hash_from_index(uint32_t index) {
+    index ^= index >> 16;
+    index *= 0x85ebca6bU;
+    index ^= index >> 13;
+    index *= 0xc2b2ae35U;
+    index ^= index >> 16;
+    return index;
+}
+
+// Typo matches keep their own band at the bottom without the provider bonus,
+// and no bonus lowers a strict match into it.
+#define STORED_STRICT_MIN (SCORE_STRICT_MIN - SCORE_BELOW_THRESHOLD)
+
+static inline int32_t stored_score(const ResultContainer* container, int32_t score) {
+    score -= SCORE_BELOW_THRESHOLD;
+    if (score < STORED_STRICT_MIN) return score;
+
+    score += container->bonus;
+    return (score >= SCORE_MAX) ? SCORE_MAX - 1 :
+                         (score < STORED_STRICT_MIN) ? STORED_STRICT_MIN :
+                         score;
+}
+
+static void publish_threshold(ResultContainer* container, int threshold) {
+    if (threshold <= container->published) return;
+    container->published = threshold;
+
+    int current = atomic_load_explicit(container->prune_threshold, memory_order_relaxed);
+    while (current < threshold &&
+           !atomic_compare_exchange_weak_explicit(container->prune_threshold, &current, threshold,
+                                                  memory_order_relaxed, memory_order_relaxed));
+}
+
+// Once this shard alone holds top_k unique items, nothing scoring below the
+// weakest of them can reach the rows that get ordered, in any shard.
+static void track_top_k(ResultContainer* container, uint16_t score) {
+    uint16_t* top = container->top;
+    int n = container->top_size;
+
+    if (n < container->top_k) {
+        if (!top) {
+            top = container->top = malloc(container->top_k * sizeof(uint16_t));
+            if (!top) {
+                container->top_k = 0;
+                return;
+            }
+        }
+        int i = container->top_size++;
+        while (i > 0 && top[(i - 1) / 2] > score) {
+            top[i] = top[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        top[i] = score;
+        if (container->top_size == container->top_k) publish_threshold(container, top[0]);
+        return;
+    }
+
+    if (score <= top[0]) return;
+
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= n) break;
+        if (child + 1 < n && top[child + 1] < top[child]) child++;
+        if (top[child] >= score) break;
+        top[i] = top[child];
+        i = child;
+    }
+    top[i] = score;
+    publish_threshold(container, top[0]);
+}
+
+// For providers that insert the match score unchanged: candidates whose
+// upper bound cannot reach the current top_k are given that bound instead
+// of a full DP, so only their order beyond the top_k rows is approximate.
+bool result_container_prune(ResultContainer* container, const char* haystack, int32_t* bound) {
+    if (!container->top_k) return false;
+
+    int threshold = atomic_load_explicit(container->prune_threshold, memory_order_relaxed);
+    if (!threshold) return false;
+
+    *bound = match_score_bound(container->string_info, haystack);
+    // the bound only covers strict matches, typos are scored below all of them anyway
+    if (*bound <= SCORE_BELOW_THRESHOLD) return !container->string_info->typo_max;
+    return stored_score(container, *bound) < threshold;
+}
+
+int32_t result_container_match_score_pruned(ResultContainer* container, const char* haystack) {
+    int32_t bound;
+    if (result_container_prune(container, haystack, &bound)) return bound;
+    return match_score(container->string_info, haystack);
 }
 
 bool result_container_insert(ResultContainer* container, uint32_t hash, int32_t score,
@@ -133,14 +339,11 @@ bool result_container_insert(ResultContainer* container, uint32_t hash, int32_t
         return false;
     }
 
-    score -= SCORE_BELOW_THRESHOLD;
-    score += container->bonus;
-    score = ((score >= SCORE_MAX) ? SCORE_MAX - 1 :
-                         (score < 0) ? 0 :
-                         score);
+    score = stored_score(container, score);
 
     if (!container->current_sheet || container->current_sheet->size >= SHEET_SIZE) {
         if (!(grab_fresh_sheet(container) || grab_sheet_from_queue(container))) {
+            atomic_fetch_add_explicit(container->dropped, 1, memory_order_relaxed);
             return false;
         }
     }
@@ -151,11 +354,15 @@ bool result_container_insert(ResultContainer* container, uint32_t hash, int32_t
 
     ResultSheet* sheet = container->current_sheet;
 
-    if (!hash) {
-        uint16_t index = (sheet->global_index << ITEM_BITS) | sheet->size;
-        hash = hash_from_pointers(container, func, factory_user_data, index);
+    if (hash) {
+        // duplicates collapse in the merge, so they never count towards the threshold
+        container->non_unique = true;
+    } else {
+        hash = hash_from_index((sheet->global_index << ITEM_BITS) | sheet->size);
+        if (container->top_k) track_top_k(container, score);
     }
-    container->local_items[container->local_items_size++] = PACK_HASH(hash, score, sheet->global_index, sheet->size);
+    container->local_items[container->local_items_size++] = PACK_HASH(hash, sheet->global_index, sheet->size);
+    sheet->scores[sheet->size] = score;
     sheet->match_pool[sheet->size++] = pack_match_data(container, func, factory_user_data, destroy_func);
     return true;
 }
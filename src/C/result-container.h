@@ -19,23 +19,24 @@ typedef BobLauncherMatch* (*MatchFactory)(void* user_data);
 #define FUNC_PAIR_SHIFT 43
 #define MAX_FUNC_SLOTS 64
 
-#define MAX_SHEETS 256          // 2^8
+#define MAX_SHEETS 32768        // 2^15
 #define SHEET_SIZE 512   // 2^9
 #define UNIQUE_SENTINEL 0
-// max number of items = 256 * 512 = 131072
+// max number of items = 32768 * 512 = 16777216
+#define MAX_ITEMS ((size_t)MAX_SHEETS * SHEET_SIZE)
+#define UNFINISHED_QUEUE_SIZE 1024
 
 #define ITEM_BITS 9     // log2(512) = 9 bits for 512 items
-#define SHEET_BITS 8    // log2(256) = 8 bits for 256 sheets
+#define SHEET_BITS 15   // log2(32768) = 15 bits for 32768 sheets
 
 #define ITEM_SHIFT 0                                           // 0
 #define SHEET_SHIFT (ITEM_BITS)                               // 9
-#define SCORE_SHIFT (ITEM_BITS + SHEET_BITS)
 #define HASH_SHIFT 32
 
-#define PACK_HASH(hash, score, sheet_index, item_index) \
+// The low 32 bits hold the global item index, the score lives in the sheet.
+#define PACK_HASH(hash, sheet_index, item_index) \
     ((uint64_t)(((uint64_t)item_index) << ITEM_SHIFT) | \
      (((uint64_t)sheet_index) << SHEET_SHIFT) | \
-     (((uint64_t)score) << SCORE_SHIFT) | \
      (((uint64_t)hash) << HASH_SHIFT))
 
 #define ITEM_IDX(packed) (((packed) >> ITEM_SHIFT) & ((1ULL << ITEM_BITS) - 1))
@@ -55,28 +56,90 @@ typedef struct _BobLauncherMatch BobLauncherMatch;
 typedef BobLauncherMatch* (*MatchFactory)(void* user_data);
 typedef void (*GDestroyNotify)(void* data);
 
+// Flushes a set records for its merge, beyond this it sorts without them
+#define MAX_FLUSH_BLOCKS (2 * MAX_SHEETS)
+
+// The items of one container_flush_items() call: where they landed and how
+// their high score byte is distributed. Counted while shards still search,
+// so the top-K merge of a unique set starts with its first histogram done.
+// Only flushes that reach past the first top_k rows are counted, the merge
+// needs no histogram unless the set grows past them.
+typedef struct {
+    uint32_t start;
+    uint16_t size;
+    bool counted;
+    uint16_t counts[256];
+} FlushBlock;
+
 typedef struct ResultSheet {
     size_t size;
     int global_index;
+    uint16_t scores[SHEET_SIZE];      // Inlined - 1KB
     uint64_t match_pool[SHEET_SIZE];  // Inlined - 4KB
 } ResultSheet;
 
+// Larger top_k values turn score pruning off rather than keep a heap that big
+#define PRUNE_MAX_TOP_K 1024
+
+#define CANDIDATE_NO_ROW UINT32_MAX
+// int16 values kept per shard for candidate rows, beyond this candidates are recorded without one
+#define CANDIDATE_ROWS_MAX (1 << 21)
+
+// DP rows of the recorded candidates, see match_score_extend()
+typedef struct {
+    int16_t* data;
+    size_t size;
+    size_t capacity;
+    uint32_t* offsets;  // parallel to the candidate ids, CANDIDATE_NO_ROW when not kept
+} CandidateRows;
+
 typedef struct ResultContainer {
     uint64_t* local_items;
     ResultSheet* current_sheet;
     size_t local_items_size;
     int16_t bonus;
+    bool non_unique;
     int match_mre_idx;
 
     ResultSheet** sheet_pool;
     uint64_t* global_items;
     atomic_int* global_items_size;
+    atomic_int* global_items_flushed;
+    uint64_t* global_keys;
+    FlushBlock* global_blocks;
+    atomic_int* global_blocks_size;
+    int count_from;  // flushes ending past this row get counts, INT_MAX without a top-K merge
     needle_info* string_info;
     needle_info* string_info_spaceless;
     uint64_t event_id;
     const char* query;
     atomic_int* global_index_counter;
+    atomic_int* dropped;
+    atomic_int* global_non_unique;
     _Atomic(ResultSheet**)* read;
+
+    // candidate ids reported by providers that support refinement
+    uint32_t* candidates;
+    int candidates_size;
+    int candidates_capacity;
+    bool record_candidates;
+    bool candidates_lost;
+    CandidateRows rows;
+
+    // best unique scores seen by this shard, a min-heap of up to top_k entries
+    atomic_int* prune_threshold;
+    uint16_t* top;
+    int top_k;
+    int top_size;
+    int published;
+
+    // the slice of the previous candidate set this container re-scores
+    const uint32_t* previous_ids;
+    const uint32_t* previous_offsets;
+    const int16_t* previous_rows;
+    int previous_count;
+    int previous_cursor;
+    int previous_needle_len;
 } ResultContainer;
 
 FuncPair get_func_pair(uint64_t packed);
@@ -89,10 +152,19 @@ bool result_container_insert(ResultContainer* container, uint32_t hash, int32_t
                             GDestroyNotify destroy_func);
 
 const char* result_container_get_query(ResultContainer* container);
+void result_container_add_candidate(ResultContainer* container, uint32_t candidate);
+// True when haystack cannot reach the ordered top rows, *bound is then an upper bound of its score
+bool result_container_prune(ResultContainer* container, const char* haystack, int32_t* bound);
+int32_t result_container_match_score_pruned(ResultContainer* container, const char* haystack);
+bool result_container_match_candidate(ResultContainer* container, uint32_t candidate, const char* haystack, int32_t* score);
 
 #define result_container_has_match(container, haystack) query_has_match(((ResultContainer*)container)->string_info, haystack)
+#define result_container_may_match(container, signature) match_signature_possible(((ResultContainer*)container)->string_info, signature)
+#define result_container_has_match_signed(container, haystack, signature) \
+    (result_container_may_match(container, signature) && result_container_has_match(container, haystack))
 #define result_container_match_score(container, haystack) match_score(((ResultContainer*)container)->string_info, haystack)
 #define result_container_match_score_spaceless(container, haystack) match_score(((ResultContainer*)container)->string_info_spaceless, haystack)
+#define result_container_match_score_batch(container, haystacks, count, scores) match_score_batch(((ResultContainer*)container)->string_info, haystacks, count, scores)
 
 extern int events_ok(int event_id);
 #define result_container_is_cancelled(container) (!events_ok(((ResultContainer*)(container))->event_id))
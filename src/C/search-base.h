@@ -28,12 +28,15 @@ struct _BobLauncherSearchBaseClass {
     void (*set_shard_count)(BobLauncherSearchBase *self, guint value);
     void (*search)(BobLauncherSearchBase *self, ResultContainer *rs);
     void (*search_shard)(BobLauncherSearchBase *self, ResultContainer *rs, guint shard_id);
+    void (*search_candidates)(BobLauncherSearchBase *self, ResultContainer *rs, guint32 *candidates, gint candidates_length1);
 };
 
 GType bob_launcher_search_base_get_type(void) G_GNUC_CONST;
 
 void bob_launcher_search_base_search(BobLauncherSearchBase *self, ResultContainer *rs);
 void bob_launcher_search_base_search_shard(BobLauncherSearchBase *self, ResultContainer *rs, guint shard_id);
+void bob_launcher_search_base_search_candidates(BobLauncherSearchBase *self, ResultContainer *rs, guint32 *candidates, gint candidates_length1);
+void bob_launcher_search_base_invalidate_candidates(BobLauncherSearchBase *self);
 void bob_launcher_search_base_handle_base_settings(BobLauncherSearchBase *self, const char *key, GVariant *value);
 BobLauncherSearchBase *bob_launcher_search_base_construct(GType object_type);
 
@@ -46,6 +49,9 @@ void bob_launcher_search_base_set_enabled_in_default_search(BobLauncherSearchBas
 const char *bob_launcher_search_base_get_regex_match(BobLauncherSearchBase *self);
 void bob_launcher_search_base_set_regex_match(BobLauncherSearchBase *self, const char *value);
 GRegex *bob_launcher_search_base_get_compiled_regex(BobLauncherSearchBase *self);
+gboolean bob_launcher_search_base_get_supports_refinement(BobLauncherSearchBase *self);
+void bob_launcher_search_base_set_supports_refinement(BobLauncherSearchBase *self, gboolean value);
+gint bob_launcher_search_base_get_candidate_generation(BobLauncherSearchBase *self);
 
 G_END_DECLS
 
@@ -0,0 +1,194 @@
+#include "signature-index.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef SPARSE_RATIO
+// Lists longer than this many times the rarest one are left to the caller's signature check
+#define SPARSE_RATIO 4
+#endif
+
+typedef struct {
+    const SignaturePostings* list;
+    int block;
+    size_t pos;
+    int left;  // postings still coded in the current block
+    uint32_t value;
+} Cursor;
+
+SignatureIndex* signature_index_new(void) {
+    return calloc(1, sizeof(SignatureIndex));
+}
+
+void signature_index_free(SignatureIndex* index) {
+    if (!index) return;
+    for (int b = 0; b < 64; b++) {
+        free(index->lists[b].data);
+        free(index->lists[b].skip_ids);
+        free(index->lists[b].skip_offsets);
+    }
+    free(index);
+}
+
+int signature_index_size(const SignatureIndex* index) {
+    return index ? index->count : 0;
+}
+
+static bool postings_append(SignaturePostings* list, uint32_t id) {
+    if (list->count % SIGNATURE_INDEX_BLOCK == 0) {
+        if (list->blocks == list->block_capacity) {
+            int capacity = list->block_capacity ? list->block_capacity * 2 : 16;
+            uint32_t* ids = realloc(list->skip_ids, capacity * sizeof(uint32_t));
+            if (!ids) return false;
+            list->skip_ids = ids;
+            uint32_t* offsets = realloc(list->skip_offsets, capacity * sizeof(uint32_t));
+            if (!offsets) return false;
+            list->skip_offsets = offsets;
+            list->block_capacity = capacity;
+        }
+        list->skip_ids[list->blocks] = id;
+        list->skip_offsets[list->blocks] = list->size;
+        list->blocks++;
+    } else {
+        if (list->size + 5 > list->capacity) {
+            size_t capacity = list->capacity ? list->capacity * 2 : 256;
+            uint8_t* data = realloc(list->data, capacity);
+            if (!data) return false;
+            list->data = data;
+            list->capacity = capacity;
+        }
+        uint32_t delta = id - list->last;
+        while (delta >= 0x80) {
+            list->data[list->size++] = (delta & 0x7F) | 0x80;
+            delta >>= 7;
+        }
+        list->data[list->size++] = delta;
+    }
+    list->last = id;
+    list->count++;
+    return true;
+}
+
+uint32_t signature_index_add(SignatureIndex* index, const char* text) {
+    const uint32_t id = index->count++;
+    for (uint64_t sig = match_signature(text); sig; sig &= sig - 1) {
+        if (!postings_append(&index->lists[__builtin_ctzll(sig)], id)) index->incomplete = true;
+    }
+    return id;
+}
+
+static inline void cursor_load(Cursor* c, int block) {
+    const SignaturePostings* list = c->list;
+    const uint32_t in_block = list->count - (uint32_t)block * SIGNATURE_INDEX_BLOCK;
+    c->block = block;
+    c->pos = list->skip_offsets[block];
+    c->left = (in_block < SIGNATURE_INDEX_BLOCK ? in_block : SIGNATURE_INDEX_BLOCK) - 1;
+    c->value = list->skip_ids[block];
+}
+
+// Moves to the first posting >= target, false once the list runs out
+static bool cursor_seek(Cursor* c, uint32_t target) {
+    if (c->value >= target) return true;
+    const SignaturePostings* list = c->list;
+
+    // last block starting at or before target
+    int lo = c->block, hi = list->blocks - 1;
+    if (lo < hi && list->skip_ids[lo + 1] <= target) {
+        lo++;
+        while (lo < hi) {
+            const int mid = lo + (hi - lo + 1) / 2;
+            if (list->skip_ids[mid] <= target) lo = mid;
+            else hi = mid - 1;
+        }
+        cursor_load(c, lo);
+    }
+
+    while (c->value < target) {
+        if (!c->left) {
+            if (c->block + 1 >= list->blocks) return false;
+            cursor_load(c, c->block + 1);
+            return true;
+        }
+        uint32_t delta = 0;
+        int shift = 0;
+        uint8_t byte;
+        do {
+            byte = list->data[c->pos++];
+            delta |= (uint32_t)(byte & 0x7F) << shift;
+            shift += 7;
+        } while (byte & 0x80);
+        c->value += delta;
+        c->left--;
+    }
+    return true;
+}
+
+static bool push_candidate(uint32_t** candidates, int* n, int* capacity, uint32_t id) {
+    if (*n == *capacity) {
+        const int grown = *capacity ? *capacity * 2 : 256;
+        uint32_t* resized = realloc(*candidates, grown * sizeof(uint32_t));
+        if (!resized) return false;
+        *candidates = resized;
+        *capacity = grown;
+    }
+    (*candidates)[(*n)++] = id;
+    return true;
+}
+
+bool signature_index_lookup(const SignatureIndex* index, ResultContainer* rc, uint32_t from, uint32_t to,
+                            uint32_t** candidates, int* n_candidates) {
+    *candidates = NULL;
+    *n_candidates = 0;
+    if (!index || !rc || index->incomplete) return false;
+
+    // the typo tier clears the signature, it matches without every character
+    const needle_info* needle = rc->string_info;
+    if (needle->len < SIGNATURE_INDEX_MIN_QUERY || !needle->signature) return false;
+
+    if (to > index->count) to = index->count;
+    if (from >= to) return true;
+
+    Cursor cursors[64];
+    int n = 0;
+    for (uint64_t sig = needle->signature; sig; sig &= sig - 1) {
+        const SignaturePostings* list = &index->lists[__builtin_ctzll(sig)];
+        if (!list->count) return true;
+
+        // rarest list first, it leads the intersection
+        int k = n++;
+        for (; k > 0 && cursors[k - 1].list->count > list->count; k--) cursors[k] = cursors[k - 1];
+        cursors[k].list = list;
+    }
+
+    // decoding a dense list costs more than the signature checks it saves
+    while (n > 1 && cursors[n - 1].list->count / SPARSE_RATIO > cursors[0].list->count) n--;
+    for (int k = 0; k < n; k++) cursor_load(&cursors[k], 0);
+
+    int capacity = 0;
+    Cursor* lead = &cursors[0];
+    bool more = cursor_seek(lead, from);
+    for (uint32_t visited = 0; more && lead->value < to; visited++) {
+        if ((visited & 1023) == 1023 && result_container_is_cancelled(rc)) break;
+
+        const uint32_t id = lead->value;
+        int k = 1;
+        for (; k < n; k++) {
+            if (!cursor_seek(&cursors[k], id)) goto out;
+            if (cursors[k].value != id) break;
+        }
+
+        if (k == n) {
+            if (!push_candidate(candidates, n_candidates, &capacity, id)) {
+                free(*candidates);
+                *candidates = NULL;
+                *n_candidates = 0;
+                return false;
+            }
+            more = cursor_seek(lead, id + 1);
+        } else {
+            more = cursor_seek(lead, cursors[k].value);
+        }
+    }
+
+out:
+    return true;
+}
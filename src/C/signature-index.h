@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "result-container.h"
+
+// Postings between skip entries, a lookup decodes at most this many per probe
+#define SIGNATURE_INDEX_BLOCK 64
+// Shorter queries leave most lists too dense to narrow anything, they scan
+#define SIGNATURE_INDEX_MIN_QUERY 3
+
+/*
+ * Ids of the entries whose match_signature() has one bit set, ascending and
+ * delta-varint coded. Every SIGNATURE_INDEX_BLOCK postings a skip entry
+ * keeps the next id uncoded together with where the block's deltas start.
+ */
+typedef struct {
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+    uint32_t* skip_ids;
+    uint32_t* skip_offsets;
+    int blocks;
+    int block_capacity;
+    uint32_t count;
+    uint32_t last;
+} SignaturePostings;
+
+/*
+ * Inverted index over the 64 match_signature() classes. A needle can only
+ * match entries in the posting list of every class it uses, so a lookup
+ * intersects those lists and visits a number of postings that follows the
+ * rarest class rather than the size of the corpus.
+ */
+typedef struct {
+    SignaturePostings lists[64];
+    uint32_t count;
+    bool incomplete;  // a posting could not be stored, lookups scan instead
+} SignatureIndex;
+
+SignatureIndex* signature_index_new(void);
+void signature_index_free(SignatureIndex* index);
+// Ids are handed out in order, starting at 0
+uint32_t signature_index_add(SignatureIndex* index, const char* text);
+int signature_index_size(const SignatureIndex* index);
+
+/*
+ * Candidate ids in [from, to) for the container's needle, ascending, in a
+ * malloc'd array. Candidates may still not match; they are meant for
+ * result_container_has_match_signed and scoring like a full scan would do.
+ * Returns false when the index cannot narrow this query (short, typo
+ * tolerant or an incomplete index), the range has to be scanned then.
+ */
+bool signature_index_lookup(const SignatureIndex* index, ResultContainer* rc, uint32_t from, uint32_t to,
+                            uint32_t** candidates, int* n_candidates);
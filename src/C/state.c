@@ -226,6 +226,7 @@ void state_update_layout(BobLauncherSearchingFor what) {
 
 void state_reset() {
     int new_event_id = events_increment();
+    hashset_cache_clear();
 
     for (int i = bob_launcher_SEARCHING_FOR_PLUGINS; i < bob_launcher_SEARCHING_FOR_COUNT; i++) {
         state_update_provider(i, state_empty_provider(new_event_id), 0);
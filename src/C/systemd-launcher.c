@@ -9,6 +9,9 @@
 #include <gio/gdesktopappinfo.h>
 #include <gdk/gdk.h>
 #include <glib.h>
+#include <glib-unix.h>
+#include <spawn.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -17,6 +20,15 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sys/syscall.h>
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+#ifndef SYS_close_range
+#define SYS_close_range 436
+#endif
 
 #define LAUNCH_FILE_ATTRIBUTES G_FILE_ATTRIBUTE_STANDARD_TYPE "," G_FILE_ATTRIBUTE_STANDARD_CONTENT_TYPE
 extern char **environ;
@@ -28,6 +40,7 @@ static int file_exists(const char *path) {
 
 struct SystemdLauncher {
     DBusConnection *connection;
+    SystemdScopeConnection *scopes;
     GSettings *settings;
     DBusScopeMonitor *scope_monitor;
     GHashTable *dbus_name_to_object_path;
@@ -40,7 +53,7 @@ struct SystemdLauncher {
 /* Forward declarations */
 static void on_dbus_event(DBusScopeEventType event_type, const char *dbus_name, const char *object_path, void *data);
 static int launch_with_systemd_scope_internal(SystemdLauncher *self, const char *app_name, char **argv, char **env, bool blocking);
-static char *create_scope_for_self(SystemdLauncher *self, const char *app_name);
+static void start_scope_for_pid(SystemdLauncher *self, const char *app_name, pid_t pid, int pidfd);
 static char *get_activation_token(GAppInfo *app_info);
 static char **get_argv_for_app(SystemdLauncher *self, GAppInfo *app_info, const char *action, GList *files);
 static char **get_argv_for_app_with_uris(SystemdLauncher *self, GAppInfo *app_info, const char *action, GList *uris);
@@ -96,6 +109,11 @@ systemd_launcher_new(DBusConnection *connection)
     self->scope_monitor = dbus_scope_monitor_new(on_dbus_event, self);
     dbus_scope_monitor_start(self->scope_monitor);
 
+    self->scopes = systemd_scope_connection_new();
+    if (self->scopes == NULL) {
+        g_warning("Failed to connect to systemd, applications will not get their own scope");
+    }
+
     return self;
 }
 
@@ -111,6 +129,10 @@ systemd_launcher_free(SystemdLauncher *self)
         dbus_scope_monitor_free(self->scope_monitor);
     }
 
+    if (self->scopes != NULL) {
+        systemd_scope_connection_free(self->scopes);
+    }
+
     if (self->settings != NULL) {
         g_object_unref(self->settings);
     }
@@ -636,75 +658,135 @@ try_activate(SystemdLauncher *self, GAppInfo *app_info, const char *app_id, cons
     return success;
 }
 
-static int
-launch_with_systemd_scope_internal(SystemdLauncher *self, const char *app_name, char **argv, char **_env, bool blocking)
+/* Runs in the forked child, never returns */
+static void
+exec_detached(char **argv, char **env)
 {
-    char **env = _env;
-    char **allocated_env = NULL;
+    /* Close all file descriptors */
+    if (syscall(SYS_close_range, 0U, ~0U, 0U) != 0) {
+        for (int fd = 0; fd < 1024; fd++) {
+            close(fd);
+        }
+    }
 
-    if (env == NULL) {
-        env = g_get_environ();
-        allocated_env = env;
+    int devnull = open("/dev/null", O_RDWR);
+    if (devnull != 0) {
+        dup2(devnull, 0);
+    }
+    dup2(devnull, 1);
+    dup2(devnull, 2);
+    if (devnull > 2) {
+        close(devnull);
     }
 
-    /* Duplicate argv for use in child process */
-    int argc = 0;
-    while (argv[argc] != NULL) {
-        argc++;
+    environ = env;
+    execvp(argv[0], argv);
+    _exit(127);
+}
+
+/*
+ * posix_spawn clones with CLONE_VM | CLONE_VFORK, so none of the launcher's
+ * page tables are copied. Returns the child's PID, or -1 with errno set.
+ * ENOSYS means this path is unavailable and the caller should fork instead.
+ */
+static pid_t
+spawn_detached(char **argv, char **env, int *pidfd)
+{
+    *pidfd = -1;
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 34))
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t no_signals, all_signals;
+    pid_t pid = -1;
+
+    sigemptyset(&no_signals);
+    sigfillset(&all_signals);
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDWR, 0);
+    posix_spawn_file_actions_adddup2(&actions, 0, 1);
+    posix_spawn_file_actions_adddup2(&actions, 0, 2);
+    posix_spawn_file_actions_addclosefrom_np(&actions, 3);
+
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID | POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+    posix_spawnattr_setsigmask(&attr, &no_signals);
+    posix_spawnattr_setsigdefault(&attr, &all_signals);
+
+    int err = posix_spawnp(&pid, argv[0], &actions, &attr, argv, env);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (err != 0) {
+        /* EINVAL: the C library or kernel rejected one of the flags */
+        errno = err == EINVAL ? ENOSYS : err;
+        return -1;
     }
 
-    char **argv_dup = malloc(sizeof(char *) * (argc + 1));
-    for (int i = 0; i < argc; i++) {
-        argv_dup[i] = strdup(argv[i]);
+    /* The child cannot be reaped before we wait for it, so its PID is still ours */
+    *pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+    return pid;
+#else
+    (void)argv;
+    (void)env;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static gboolean
+on_child_exited(int pidfd, GIOCondition condition, gpointer user_data)
+{
+    (void)condition;
+
+    waitpid(GPOINTER_TO_INT(user_data), NULL, WNOHANG);
+    close(pidfd);
+    return G_SOURCE_REMOVE;
+}
+
+static void
+on_child_watch(GPid pid, int status, gpointer user_data)
+{
+    (void)pid;
+    (void)status;
+    (void)user_data;
+}
+
+/* Detached children are reaped from the main loop instead of being double forked */
+static void
+reap_when_exited(pid_t pid, int pidfd)
+{
+    if (pidfd >= 0) {
+        g_unix_fd_add(pidfd, G_IO_IN, on_child_exited, GINT_TO_POINTER(pid));
+    } else {
+        g_child_watch_add(pid, on_child_watch, NULL);
     }
-    argv_dup[argc] = NULL;
+}
 
+static int
+launch_forked(SystemdLauncher *self, const char *app_name, char **argv_dup, char **env, bool blocking)
+{
     if (blocking) {
         pid_t child_pid = fork();
 
         if (child_pid < 0) {
             g_critical("Failed to fork child process");
-            g_strfreev(allocated_env);
-            g_strfreev(argv_dup);
             return -1;
         } else if (child_pid == 0) {
             /* Child process */
             setsid();
-
-            char *scope_name = create_scope_for_self(self, app_name);
-            if (scope_name == NULL) {
-                g_warning("Failed to create systemd scope");
-                _exit(1);
-            }
-            free(scope_name);
-
-            /* Close all file descriptors */
-            for (int fd = 0; fd < 1024; fd++) {
-                close(fd);
-            }
-
-            int devnull = open("/dev/null", O_RDWR);
-            if (devnull != 0) {
-                dup2(devnull, 0);
-            }
-            dup2(devnull, 1);
-            dup2(devnull, 2);
-            if (devnull > 2) {
-                close(devnull);
-            }
-
-            environ = env;
-            execvp(argv_dup[0], argv_dup);
-            _exit(127);
+            exec_detached(argv_dup, env);
         }
 
+        /* The scope is attached by PID while the child is already running */
+        start_scope_for_pid(self, app_name, child_pid, -1);
+
         /* Parent process - wait for child */
         int status;
         waitpid(child_pid, &status, 0);
 
-        g_strfreev(allocated_env);
-        g_strfreev(argv_dup);
-
         if (WIFEXITED(status)) {
             return WEXITSTATUS(status);
         } else if (WIFSIGNALED(status)) {
@@ -712,76 +794,137 @@ launch_with_systemd_scope_internal(SystemdLauncher *self, const char *app_name,
         } else {
             return -1;
         }
-    } else {
-        /* Non-blocking: double fork */
-        pid_t child_pid = fork();
-
-        if (child_pid < 0) {
-            g_critical("Failed to fork child process");
-            g_strfreev(allocated_env);
-            g_strfreev(argv_dup);
-            return -1;
-        } else if (child_pid == 0) {
-            /* First child */
-            pid_t grandchild_pid = fork();
-
-            if (grandchild_pid < 0) {
-                _exit(1);
-            } else if (grandchild_pid == 0) {
-                /* Grandchild */
-                setsid();
-
-                char *scope_name = create_scope_for_self(self, app_name);
-                if (scope_name == NULL) {
-                    g_warning("Failed to create systemd scope");
-                    _exit(1);
-                }
-                free(scope_name);
+    }
 
-                /* Close all file descriptors */
-                for (int fd = 0; fd < 1024; fd++) {
-                    close(fd);
-                }
+    /* Non-blocking: double fork, the first child reports the grandchild's PID */
+    int pid_pipe[2];
+    if (pipe(pid_pipe) != 0) {
+        g_critical("Failed to create pipe: %s", strerror(errno));
+        return -1;
+    }
 
-                int devnull = open("/dev/null", O_RDWR);
-                if (devnull != 0) {
-                    dup2(devnull, 0);
-                }
-                dup2(devnull, 1);
-                dup2(devnull, 2);
-                if (devnull > 2) {
-                    close(devnull);
-                }
+    pid_t child_pid = fork();
 
-                environ = env;
-                execvp(argv_dup[0], argv_dup);
-                g_warning("Failed to exec %s: %s", argv_dup[0], strerror(errno));
-                _exit(127);
-            } else {
-                /* First child exits immediately */
-                _exit(0);
-            }
+    if (child_pid < 0) {
+        g_critical("Failed to fork child process");
+        close(pid_pipe[0]);
+        close(pid_pipe[1]);
+        return -1;
+    } else if (child_pid == 0) {
+        /* First child */
+        close(pid_pipe[0]);
+        pid_t grandchild_pid = fork();
+
+        if (grandchild_pid < 0) {
+            _exit(1);
+        } else if (grandchild_pid == 0) {
+            /* Grandchild */
+            setsid();
+            exec_detached(argv_dup, env);
+        } else {
+            /* First child exits immediately */
+            ssize_t written = write(pid_pipe[1], &grandchild_pid, sizeof(grandchild_pid));
+            _exit(written == sizeof(grandchild_pid) ? 0 : 1);
         }
+    }
 
-        /* Parent waits for first child (which exits immediately) */
-        int status;
-        waitpid(child_pid, &status, 0);
+    close(pid_pipe[1]);
 
-        g_strfreev(allocated_env);
-        g_strfreev(argv_dup);
+    pid_t grandchild_pid = -1;
+    ssize_t n;
+    do {
+        n = read(pid_pipe[0], &grandchild_pid, sizeof(grandchild_pid));
+    } while (n < 0 && errno == EINTR);
+    close(pid_pipe[0]);
 
-        if (status != 0) {
-            g_warning("Child process exited with status %d", status);
-            return -1;
+    /* Parent waits for first child (which exits immediately) */
+    int status;
+    waitpid(child_pid, &status, 0);
+
+    if (status != 0 || n != sizeof(grandchild_pid)) {
+        g_warning("Child process exited with status %d", status);
+        return -1;
+    }
+
+    start_scope_for_pid(self, app_name, grandchild_pid, -1);
+    return 0;
+}
+
+static int
+launch_spawned(SystemdLauncher *self, const char *app_name, char **argv_dup, char **env, bool blocking)
+{
+    int pidfd;
+    pid_t child_pid = spawn_detached(argv_dup, env, &pidfd);
+
+    if (child_pid < 0) {
+        if (errno == ENOSYS) {
+            return launch_forked(self, app_name, argv_dup, env, blocking);
         }
 
+        g_warning("Failed to exec %s: %s", argv_dup[0], strerror(errno));
+        return blocking ? 127 : -1;
+    }
+
+    start_scope_for_pid(self, app_name, child_pid, pidfd);
+
+    if (!blocking) {
+        reap_when_exited(child_pid, pidfd);
         return 0;
     }
+
+    int status;
+    waitpid(child_pid, &status, 0);
+    if (pidfd >= 0) {
+        close(pidfd);
+    }
+
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    } else if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    } else {
+        return -1;
+    }
 }
 
-static char *
-create_scope_for_self(SystemdLauncher *self, const char *app_name)
+static int
+launch_with_systemd_scope_internal(SystemdLauncher *self, const char *app_name, char **argv, char **_env, bool blocking)
 {
+    char **env = _env;
+    char **allocated_env = NULL;
+
+    if (env == NULL) {
+        env = g_get_environ();
+        allocated_env = env;
+    }
+
+    /* Duplicate argv for use in child process */
+    int argc = 0;
+    while (argv[argc] != NULL) {
+        argc++;
+    }
+
+    char **argv_dup = malloc(sizeof(char *) * (argc + 1));
+    for (int i = 0; i < argc; i++) {
+        argv_dup[i] = strdup(argv[i]);
+    }
+    argv_dup[argc] = NULL;
+
+    int result = launch_spawned(self, app_name, argv_dup, env, blocking);
+
+    g_strfreev(allocated_env);
+    g_strfreev(argv_dup);
+
+    return result;
+}
+
+static void
+start_scope_for_pid(SystemdLauncher *self, const char *app_name, pid_t pid, int pidfd)
+{
+    if (self->scopes == NULL) {
+        return;
+    }
+
     GString *escaped_name = g_string_new(NULL);
 
     /* Escape app name: keep alphanumeric, ':', '_', '.'; escape others */
@@ -801,7 +944,7 @@ create_scope_for_self(SystemdLauncher *self, const char *app_name)
         p++;
     }
 
-    char *scope_name = g_strdup_printf("%s-%d.scope", escaped_name->str, (int)getpid());
+    char *scope_name = g_strdup_printf("%s-%d.scope", escaped_name->str, (int)pid);
     g_string_free(escaped_name, TRUE);
 
     const char *unit_slice;
@@ -813,16 +956,11 @@ create_scope_for_self(SystemdLauncher *self, const char *app_name)
         unit_slice = self->own_slice;
     }
 
-    char *job_path = create_systemd_scope_lowlevel(unit_slice, scope_name, getpid());
-
-    if (job_path != NULL) {
-        free(job_path);
-        return scope_name;
-    } else {
+    if (!systemd_scope_start(self->scopes, unit_slice, scope_name, pid, pidfd)) {
         g_warning("Failed to create systemd scope");
-        g_free(scope_name);
-        return NULL;
     }
+
+    g_free(scope_name);
 }
 
 static char **
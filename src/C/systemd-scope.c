@@ -1,16 +1,126 @@
 #include <dbus/dbus.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+#include "systemd-scope.h"
+
+#define JOB_PREFIX "/org/freedesktop/systemd1/job/"
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+typedef struct PendingScope {
+    dbus_uint32_t serial;
+    dbus_uint32_t job_id;
+    pid_t pid;
+    int pidfd;
+    bool used_pidfd;
+    char* slice;
+    char* scope_name;
+    struct PendingScope* next;
+} PendingScope;
+
+// Only the dispatch thread touches the connection. libdbus holds its I/O path
+// while that thread waits for traffic, so a send from any other thread would
+// sit in the queue until some unrelated message arrived. Callers hand their
+// requests over through `outgoing` and wake the thread with `wake_fd`.
+struct SystemdScopeConnection {
+    DBusConnection* conn;
+    pthread_t thread;
+    int wake_fd;
+    atomic_int should_stop;
+    atomic_int pidfds_unsupported;
+    pthread_mutex_t outgoing_mutex;
+    PendingScope* outgoing;
+    PendingScope* pending;       // dispatch thread only
+};
+
+static bool append_property_string(DBusMessageIter* array, const char* key, const char* value) {
+    DBusMessageIter dict_entry, variant;
+
+    if (!dbus_message_iter_open_container(array, DBUS_TYPE_STRUCT, NULL, &dict_entry)) return false;
+    if (!dbus_message_iter_append_basic(&dict_entry, DBUS_TYPE_STRING, &key)) return false;
+    if (!dbus_message_iter_open_container(&dict_entry, DBUS_TYPE_VARIANT, "s", &variant)) return false;
+    if (!dbus_message_iter_append_basic(&variant, DBUS_TYPE_STRING, &value)) return false;
+    if (!dbus_message_iter_close_container(&dict_entry, &variant)) return false;
+    return dbus_message_iter_close_container(array, &dict_entry);
+}
+
+/* PIDFDs pins the exact process, PIDs is the fallback for systemd < 253 */
+static bool append_property_process(DBusMessageIter* array, pid_t pid, int pidfd) {
+    DBusMessageIter dict_entry, variant, array_iter;
+    const char* key = pidfd >= 0 ? "PIDFDs" : "PIDs";
+
+    if (!dbus_message_iter_open_container(array, DBUS_TYPE_STRUCT, NULL, &dict_entry)) return false;
+    if (!dbus_message_iter_append_basic(&dict_entry, DBUS_TYPE_STRING, &key)) return false;
+    if (!dbus_message_iter_open_container(&dict_entry, DBUS_TYPE_VARIANT, pidfd >= 0 ? "ah" : "au", &variant)) return false;
+    if (!dbus_message_iter_open_container(&variant, DBUS_TYPE_ARRAY, pidfd >= 0 ? "h" : "u", &array_iter)) return false;
+
+    if (pidfd >= 0) {
+        if (!dbus_message_iter_append_basic(&array_iter, DBUS_TYPE_UNIX_FD, &pidfd)) return false;
+    } else {
+        dbus_uint32_t pid_uint = (dbus_uint32_t)pid;
+        if (!dbus_message_iter_append_basic(&array_iter, DBUS_TYPE_UINT32, &pid_uint)) return false;
+    }
+
+    if (!dbus_message_iter_close_container(&variant, &array_iter)) return false;
+    if (!dbus_message_iter_close_container(&dict_entry, &variant)) return false;
+    return dbus_message_iter_close_container(array, &dict_entry);
+}
+
+static DBusMessage* new_start_transient_unit(const char* slice_value, const char* scope_name, pid_t pid, int pidfd) {
+    DBusMessageIter args, array, aux_array;
+    const char* mode = "fail";
+
+    DBusMessage* msg = dbus_message_new_method_call("org.freedesktop.systemd1",
+                                                    "/org/freedesktop/systemd1",
+                                                    "org.freedesktop.systemd1.Manager",
+                                                    "StartTransientUnit");
+    if (NULL == msg) {
+        fprintf(stderr, "Message Null\n");
+        return NULL;
+    }
+
+    dbus_message_iter_init_append(msg, &args);
+
+    if (!dbus_message_iter_append_basic(&args, DBUS_TYPE_STRING, &scope_name) ||
+        !dbus_message_iter_append_basic(&args, DBUS_TYPE_STRING, &mode) ||
+        !dbus_message_iter_open_container(&args, DBUS_TYPE_ARRAY, "(sv)", &array) ||
+        !append_property_process(&array, pid, pidfd) ||
+        !append_property_string(&array, "Slice", slice_value) ||
+        !append_property_string(&array, "CollectMode", "inactive-or-failed") ||
+        !dbus_message_iter_close_container(&args, &array) ||
+        !dbus_message_iter_open_container(&args, DBUS_TYPE_ARRAY, "(sa(sv))", &aux_array) ||
+        !dbus_message_iter_close_container(&args, &aux_array)) {
+        fprintf(stderr, "Out Of Memory!\n");
+        dbus_message_unref(msg);
+        return NULL;
+    }
+
+    return msg;
+}
+
+static dbus_uint32_t job_id_from_path(const char* job_path) {
+    if (strncmp(job_path, JOB_PREFIX, strlen(JOB_PREFIX)) != 0) return 0;
+    return (dbus_uint32_t)atoi(job_path + strlen(JOB_PREFIX));
+}
 
 char* create_systemd_scope_lowlevel(const char* slice_value, const char* scope_name, pid_t pid) {
     DBusError err;
     DBusConnection* conn;
     DBusMessage* msg;
     DBusMessage* reply;
-    DBusMessageIter args, array, dict, variant, dict_entry;
     char* job_path = NULL;
     char* scope_object_path = NULL;
     dbus_uint32_t job_id = 0;
@@ -39,157 +149,13 @@ char* create_systemd_scope_lowlevel(const char* slice_value, const char* scope_n
     }
     dbus_connection_flush(conn);
 
-    msg = dbus_message_new_method_call("org.freedesktop.systemd1",
-                                       "/org/freedesktop/systemd1",
-                                       "org.freedesktop.systemd1.Manager",
-                                       "StartTransientUnit");
+    msg = new_start_transient_unit(slice_value, scope_name, pid, -1);
     if (NULL == msg) {
-        fprintf(stderr, "Message Null\n");
         dbus_connection_unref(conn);
         return NULL;
     }
 
-    dbus_message_iter_init_append(msg, &args);
-
-    if (!dbus_message_iter_append_basic(&args, DBUS_TYPE_STRING, &scope_name)) {
-        fprintf(stderr, "Out Of Memory!\n");
-        goto cleanup;
-    }
-
-    const char* mode = "fail";
-    if (!dbus_message_iter_append_basic(&args, DBUS_TYPE_STRING, &mode)) {
-        fprintf(stderr, "Out Of Memory!\n");
-        goto cleanup;
-    }
-
-    if (!dbus_message_iter_open_container(&args, DBUS_TYPE_ARRAY, "(sv)", &array)) {
-        fprintf(stderr, "Out Of Memory!\n");
-        goto cleanup;
-    }
-
-    if (!dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT, NULL, &dict_entry)) {
-        fprintf(stderr, "Out Of Memory!\n");
-        goto cleanup;
-    }
-
-    const char* pids_key = "PIDs";
-    if (!dbus_message_iter_append_basic(&dict_entry, DBUS_TYPE_STRING, &pids_key)) {
-        fprintf(stderr, "Out Of Memory!\n");
-        goto cleanup;
-    }
-
-    if (!dbus_message_iter_open_container(&dict_entry, DBUS_TYPE_VARIANT, "au", &variant)) {
-        fprintf(stderr, "Out Of Memory!\n");
-        goto cleanup;
-    }
-
-    DBusMessageIter array_iter;
-    if (!dbus_message_iter_open_container(&variant, DBUS_TYPE_ARRAY, "u", &array_iter)) {
-        fprintf(stderr, "Out Of Memory!\n");
-        goto cleanup;
-    }
-
-    dbus_uint32_t pid_uint = (dbus_uint32_t)pid;
-    if (!dbus_message_iter_append_basic(&array_iter, DBUS_TYPE_UINT32, &pid_uint)) {
-        fprintf(stderr, "Out Of Memory!\n");
-        goto cleanup;
-    }
-
-    if (!dbus_message_iter_close_container(&variant, &array_iter)) {
-        fprintf(stderr, "Out Of Memory!\n");
-        goto cleanup;
-    }
-
-    if (!dbus_message_iter_close_container(&dict_entry, &variant)) {
-        fprintf(stderr, "Out Of Memory!\n");
-        goto cleanup;
-    }
-
-    if (!dbus_message_iter_close_container(&array, &dict_entry)) {
-        fprintf(stderr, "Out Of Memory!\n");
-        goto cleanup;
-    }
-
-    if (!dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT, NULL, &dict_entry)) {
-        fprintf(stderr, "Out Of Memory!\n");
-        goto cleanup;
-    }
-
-    const char* slice_key = "Slice";
-    if (!dbus_message_iter_append_basic(&dict_entry, DBUS_TYPE_STRING, &slice_key)) {
-        fprintf(stderr, "Out Of Memory!\n");
-        goto cleanup;
-    }
-
-    if (!dbus_message_iter_open_container(&dict_entry, DBUS_TYPE_VARIANT, "s", &variant)) {
-        fprintf(stderr, "Out Of Memory!\n");
-        goto cleanup;
-    }
-
-    if (!dbus_message_iter_append_basic(&variant, DBUS_TYPE_STRING, &slice_value)) {
-        fprintf(stderr, "Out Of Memory!\n");
-        goto cleanup;
-    }
-
-    if (!dbus_message_iter_close_container(&dict_entry, &variant)) {
-        fprintf(stderr, "Out Of Memory!\n");
-        goto cleanup;
-    }
-
-    if (!dbus_message_iter_close_container(&array, &dict_entry)) {
-        fprintf(stderr, "Out Of Memory!\n");
-        goto cleanup;
-    }
-
-    if (!dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT, NULL, &dict_entry)) {
-        fprintf(stderr, "Out Of Memory!\n");
-        goto cleanup;
-    }
-
-    const char* collect_key = "CollectMode";
-    if (!dbus_message_iter_append_basic(&dict_entry, DBUS_TYPE_STRING, &collect_key)) {
-        fprintf(stderr, "Out Of Memory!\n");
-        goto cleanup;
-    }
-
-    if (!dbus_message_iter_open_container(&dict_entry, DBUS_TYPE_VARIANT, "s", &variant)) {
-        fprintf(stderr, "Out Of Memory!\n");
-        goto cleanup;
-    }
-
-    const char* collect_value = "inactive-or-failed";
-    if (!dbus_message_iter_append_basic(&variant, DBUS_TYPE_STRING, &collect_value)) {
-        fprintf(stderr, "Out Of Memory!\n");
-        goto cleanup;
-    }
-
-    if (!dbus_message_iter_close_container(&dict_entry, &variant)) {
-        fprintf(stderr, "Out Of Memory!\n");
-        goto cleanup;
-    }
-
-    if (!dbus_message_iter_close_container(&array, &dict_entry)) {
-        fprintf(stderr, "Out Of Memory!\n");
-        goto cleanup;
-    }
-
-    if (!dbus_message_iter_close_container(&args, &array)) {
-        fprintf(stderr, "Out Of Memory!\n");
-        goto cleanup;
-    }
-
-    DBusMessageIter aux_array;
-    if (!dbus_message_iter_open_container(&args, DBUS_TYPE_ARRAY, "(sa(sv))", &aux_array)) {
-        fprintf(stderr, "Out Of Memory!\n");
-        goto cleanup;
-    }
-    if (!dbus_message_iter_close_container(&args, &aux_array)) {
-        fprintf(stderr, "Out Of Memory!\n");
-        goto cleanup;
-    }
-
     reply = dbus_connection_send_with_reply_and_block(conn, msg, -1, &err);
-
     if (dbus_error_is_set(&err)) {
         fprintf(stderr, "Error sending message: %s\n", err.message);
         dbus_error_free(&err);
@@ -212,12 +178,7 @@ char* create_systemd_scope_lowlevel(const char* slice_value, const char* scope_n
         char* path;
         dbus_message_iter_get_basic(&reply_args, &path);
         job_path = strdup(path);
-
-        const char* job_prefix = "/org/freedesktop/systemd1/job/";
-        if (strncmp(job_path, job_prefix, strlen(job_prefix)) == 0) {
-            const char* job_id_str = job_path + strlen(job_prefix);
-            job_id = (dbus_uint32_t)atoi(job_id_str);
-        }
+        job_id = job_id_from_path(job_path);
     }
 
     dbus_message_unref(reply);
@@ -278,6 +239,300 @@ cleanup:
 }
 
 
+
+static bool send_start_scope(SystemdScopeConnection* sc, PendingScope* scope) {
+    int pidfd = atomic_load(&sc->pidfds_unsupported) ? -1 : scope->pidfd;
+
+    // the message holds its own duplicate of the fd
+    DBusMessage* msg = new_start_transient_unit(scope->slice, scope->scope_name, scope->pid, pidfd);
+    if (NULL == msg) return false;
+
+    scope->used_pidfd = pidfd >= 0;
+
+    // the reply is dispatched on this thread too, so the serial is known by then
+    bool sent = dbus_connection_send(sc->conn, msg, &scope->serial);
+    if (sent) {
+        scope->next = sc->pending;
+        sc->pending = scope;
+    }
+
+    dbus_message_unref(msg);
+    return sent;
+}
+
+static void pending_scope_free(PendingScope* scope) {
+    if (scope->pidfd >= 0) close(scope->pidfd);
+    free(scope->slice);
+    free(scope->scope_name);
+    free(scope);
+}
+
+static PendingScope* take_pending(SystemdScopeConnection* sc, dbus_uint32_t serial, dbus_uint32_t job_id) {
+    PendingScope** link = &sc->pending;
+    while (*link && !(serial ? (*link)->serial == serial : (*link)->job_id == job_id))
+        link = &(*link)->next;
+
+    PendingScope* found = *link;
+    if (found) *link = found->next;
+    return found;
+}
+
+static void free_scope_list(PendingScope* scope) {
+    while (scope) {
+        PendingScope* next = scope->next;
+        pending_scope_free(scope);
+        scope = next;
+    }
+}
+
+static void handle_reply(SystemdScopeConnection* sc, DBusMessage* msg, PendingScope* scope) {
+    if (dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_ERROR) {
+        const char* name = dbus_message_get_error_name(msg);
+        bool unknown_property = scope->used_pidfd &&
+            (strcmp(name, DBUS_ERROR_INVALID_ARGS) == 0 ||
+             strcmp(name, DBUS_ERROR_NOT_SUPPORTED) == 0 ||
+             strcmp(name, DBUS_ERROR_PROPERTY_READ_ONLY) == 0);
+
+        if (unknown_property) {
+            atomic_store(&sc->pidfds_unsupported, 1);
+            if (send_start_scope(sc, scope)) return;
+        }
+
+        fprintf(stderr, "Failed to create scope %s: %s\n", scope->scope_name, name);
+        pending_scope_free(scope);
+        return;
+    }
+
+    const char* job_path = NULL;
+    if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_OBJECT_PATH, &job_path, DBUS_TYPE_INVALID) ||
+        (scope->job_id = job_id_from_path(job_path)) == 0) {
+        pending_scope_free(scope);
+        return;
+    }
+
+    if (scope->pidfd >= 0) {
+        close(scope->pidfd);
+        scope->pidfd = -1;
+    }
+
+    // systemd sends the reply before JobRemoved and both arrive on this thread
+    scope->serial = 0;
+    scope->next = sc->pending;
+    sc->pending = scope;
+}
+
+static void handle_job_removed(SystemdScopeConnection* sc, DBusMessage* msg) {
+    dbus_uint32_t job_id;
+    const char* job_path;
+    const char* unit;
+    const char* result;
+
+    if (!dbus_message_get_args(msg, NULL,
+                               DBUS_TYPE_UINT32, &job_id,
+                               DBUS_TYPE_OBJECT_PATH, &job_path,
+                               DBUS_TYPE_STRING, &unit,
+                               DBUS_TYPE_STRING, &result,
+                               DBUS_TYPE_INVALID)) {
+        return;
+    }
+
+    PendingScope* scope = take_pending(sc, 0, job_id);
+    if (!scope) return;
+
+    if (strcmp(result, "done") != 0) {
+        fprintf(stderr, "Job for %s failed with result: %s\n", unit, result);
+    }
+    pending_scope_free(scope);
+}
+
+static DBusHandlerResult scope_filter(DBusConnection* conn, DBusMessage* msg, void* user_data) {
+    (void)conn;
+    SystemdScopeConnection* sc = user_data;
+
+    int type = dbus_message_get_type(msg);
+    if (type == DBUS_MESSAGE_TYPE_METHOD_RETURN || type == DBUS_MESSAGE_TYPE_ERROR) {
+        PendingScope* scope = take_pending(sc, dbus_message_get_reply_serial(msg), 0);
+        if (!scope) return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+        handle_reply(sc, msg, scope);
+        return DBUS_HANDLER_RESULT_HANDLED;
+    }
+
+    if (dbus_message_is_signal(msg, "org.freedesktop.systemd1.Manager", "JobRemoved")) {
+        handle_job_removed(sc, msg);
+        return DBUS_HANDLER_RESULT_HANDLED;
+    }
+
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+// Sends what was queued since the last wakeup, in the order it was queued
+static void send_outgoing(SystemdScopeConnection* sc) {
+    pthread_mutex_lock(&sc->outgoing_mutex);
+    PendingScope* queued = sc->outgoing;
+    sc->outgoing = NULL;
+    pthread_mutex_unlock(&sc->outgoing_mutex);
+
+    PendingScope* ordered = NULL;
+    while (queued) {
+        PendingScope* next = queued->next;
+        queued->next = ordered;
+        ordered = queued;
+        queued = next;
+    }
+
+    while (ordered) {
+        PendingScope* next = ordered->next;
+        if (!send_start_scope(sc, ordered)) {
+            fprintf(stderr, "Failed to request scope %s\n", ordered->scope_name);
+            pending_scope_free(ordered);
+        }
+        ordered = next;
+    }
+}
+
+static void* scope_thread(void* arg) {
+    SystemdScopeConnection* sc = arg;
+
+    int bus_fd = -1;
+    if (!dbus_connection_get_unix_fd(sc->conn, &bus_fd)) return NULL;
+
+    while (!atomic_load(&sc->should_stop) && dbus_connection_get_is_connected(sc->conn)) {
+        send_outgoing(sc);
+
+        struct pollfd fds[2] = {
+            { .fd = sc->wake_fd, .events = POLLIN },
+            { .fd = bus_fd, .events = POLLIN },
+        };
+        if (dbus_connection_has_messages_to_send(sc->conn)) fds[1].events |= POLLOUT;
+
+        // libdbus may already have read messages it has not dispatched yet
+        if (dbus_connection_get_dispatch_status(sc->conn) != DBUS_DISPATCH_DATA_REMAINS &&
+            poll(fds, 2, -1) < 0 && errno != EINTR) {
+            break;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            uint64_t wakeups;
+            if (read(sc->wake_fd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN) break;
+        }
+
+        dbus_connection_read_write(sc->conn, 0);
+        while (dbus_connection_dispatch(sc->conn) == DBUS_DISPATCH_DATA_REMAINS) {
+            ;
+        }
+    }
+
+    return NULL;
+}
+
+static void wake_scope_thread(SystemdScopeConnection* sc) {
+    const uint64_t one = 1;
+    if (write(sc->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        fprintf(stderr, "Failed to wake scope thread: %s\n", strerror(errno));
+}
+
+SystemdScopeConnection* systemd_scope_connection_new(void) {
+    DBusError err;
+    dbus_error_init(&err);
+
+    SystemdScopeConnection* sc = calloc(1, sizeof(SystemdScopeConnection));
+    if (!sc) return NULL;
+
+    sc->conn = dbus_bus_get_private(DBUS_BUS_SESSION, &err);
+    if (dbus_error_is_set(&err)) {
+        fprintf(stderr, "Connection Error (%s)\n", err.message);
+        dbus_error_free(&err);
+        free(sc);
+        return NULL;
+    }
+    dbus_connection_set_exit_on_disconnect(sc->conn, FALSE);
+
+    dbus_bus_add_match(sc->conn,
+        "type='signal',interface='org.freedesktop.systemd1.Manager',member='JobRemoved'",
+        &err);
+    if (dbus_error_is_set(&err)) {
+        fprintf(stderr, "Add match error: %s\n", err.message);
+        dbus_error_free(&err);
+        dbus_connection_close(sc->conn);
+        dbus_connection_unref(sc->conn);
+        free(sc);
+        return NULL;
+    }
+
+    if (!dbus_connection_can_send_type(sc->conn, DBUS_TYPE_UNIX_FD))
+        atomic_store(&sc->pidfds_unsupported, 1);
+
+    sc->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (sc->wake_fd < 0) {
+        fprintf(stderr, "Failed to create scope wakeup: %s\n", strerror(errno));
+        dbus_connection_close(sc->conn);
+        dbus_connection_unref(sc->conn);
+        free(sc);
+        return NULL;
+    }
+
+    pthread_mutex_init(&sc->outgoing_mutex, NULL);
+    dbus_connection_add_filter(sc->conn, scope_filter, sc, NULL);
+
+    if (pthread_create(&sc->thread, NULL, scope_thread, sc) != 0) {
+        fprintf(stderr, "Failed to create scope thread\n");
+        dbus_connection_remove_filter(sc->conn, scope_filter, sc);
+        pthread_mutex_destroy(&sc->outgoing_mutex);
+        close(sc->wake_fd);
+        dbus_connection_close(sc->conn);
+        dbus_connection_unref(sc->conn);
+        free(sc);
+        return NULL;
+    }
+
+    return sc;
+}
+
+void systemd_scope_connection_free(SystemdScopeConnection* sc) {
+    if (!sc) return;
+
+    atomic_store(&sc->should_stop, 1);
+    wake_scope_thread(sc);
+    pthread_join(sc->thread, NULL);
+
+    dbus_connection_remove_filter(sc->conn, scope_filter, sc);
+    dbus_connection_close(sc->conn);
+    dbus_connection_unref(sc->conn);
+
+    free_scope_list(sc->outgoing);
+    free_scope_list(sc->pending);
+    pthread_mutex_destroy(&sc->outgoing_mutex);
+    close(sc->wake_fd);
+
+    free(sc);
+}
+
+bool systemd_scope_start(SystemdScopeConnection* sc, const char* slice_value, const char* scope_name, pid_t pid, int pidfd) {
+    PendingScope* scope = calloc(1, sizeof(PendingScope));
+    if (!scope) return false;
+
+    scope->pid = pid;
+    scope->pidfd = -1;
+    if (!atomic_load(&sc->pidfds_unsupported)) {
+        scope->pidfd = pidfd >= 0 ? fcntl(pidfd, F_DUPFD_CLOEXEC, 3) :
+                                    (int)syscall(SYS_pidfd_open, pid, 0);
+    }
+    scope->slice = strdup(slice_value);
+    scope->scope_name = strdup(scope_name);
+    if (!scope->slice || !scope->scope_name) {
+        pending_scope_free(scope);
+        return false;
+    }
+
+    pthread_mutex_lock(&sc->outgoing_mutex);
+    scope->next = sc->outgoing;
+    sc->outgoing = scope;
+    pthread_mutex_unlock(&sc->outgoing_mutex);
+
+    wake_scope_thread(sc);
+    return true;
+}
+
 /* Get the cgroup path for a given PID */
 static int get_pid_cgroup_path(pid_t pid, char **path) {
     char proc_path[256];
@@ -1,8 +1,18 @@
 #ifndef SYSTEMD_SCOPE_LOWLEVEL_H
 #define SYSTEMD_SCOPE_LOWLEVEL_H
 
+#include <stdbool.h>
 #include <unistd.h>
 
+// A private session bus connection with its own dispatch thread. Scopes are
+// requested without waiting, the job results are checked on that thread.
+typedef struct SystemdScopeConnection SystemdScopeConnection;
+
+SystemdScopeConnection* systemd_scope_connection_new(void);
+void systemd_scope_connection_free(SystemdScopeConnection* sc);
+// pidfd may be -1, the connection then opens one for pid itself
+bool systemd_scope_start(SystemdScopeConnection* sc, const char* slice_value, const char* scope_name, pid_t pid, int pidfd);
+
 char* create_systemd_scope_lowlevel(const char* slice_value, const char* scope_name, pid_t pid);
 int get_caller_systemd_slice(char **slice);
 int get_pid_systemd_slice(pid_t pid, char **slice);
@@ -3,6 +3,7 @@ namespace BobLauncher {
         public virtual uint shard_count { get; set; default = 1; }
         public uint update_interval { get; set; }
         public bool enabled_in_default_search { get; set; }
+        public bool supports_refinement { get; protected set; default = false; }
         private string _regex_match = "^$";
         private GLib.Regex _compiled_regex;
 
@@ -19,6 +20,19 @@ namespace BobLauncher {
             get { return _compiled_regex; }
         }
 
+        private int _candidate_generation = 0;
+
+        public int candidate_generation {
+            get { return Atomics.load(ref _candidate_generation); }
+        }
+
+        // Drops the candidate lists and cached result sets kept from earlier
+        // searches. Call it whenever what the provider finds changes, whether
+        // or not it supports refinement.
+        protected void invalidate_candidates() {
+            Atomics.inc(ref _candidate_generation);
+        }
+
         private bool update_compiled_regex(string new_value) {
             try {
                 _compiled_regex = new GLib.Regex(new_value, GLib.RegexCompileFlags.OPTIMIZE, 0);
@@ -54,5 +68,11 @@ namespace BobLauncher {
             }
             search(rs);
         }
+
+        // Re-scores candidates this provider reported with ResultContainer.add_candidate
+        // during an earlier search whose query the current one extends.
+        public virtual void search_candidates(ResultContainer rs, uint32[] candidates) {
+            error("Plugin supports refinement but has not implemented search_candidates");
+        }
     }
 }
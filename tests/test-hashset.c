@@ -0,0 +1,103 @@
+// Merge tests for HashSet. Sets are filled through a result container the way
+// providers fill them, then merged on the calling thread.
+
+#include <stdint.h>
+#include <glib.h>
+
+#include "hashset.h"
+#include "match.h"
+
+extern void thread_pool_init(uint16_t n);
+
+// The match of a row is its id, shifted the way match data is packed
+#define ROW_DATA(id) ((void*)(uintptr_t)(((id) + 1) << 4))
+#define ROW_ID(match) ((int)((uintptr_t)(match) >> 4) - 1)
+
+static BobLauncherMatch* row_match(void* user_data) {
+    return user_data;
+}
+
+static void merge_on_this_thread(HashSet* set) {
+    hashset_seal(set);
+    set->merge_workers = 1;
+    hashset_plan_merge(set);
+    merge_hashset_parallel(set, 0);
+}
+
+// Every row of one low hash byte lands in one dedup partition. Exactly
+// PARTITION_TABLE_ROWS of them used to overflow the table on the stack.
+#define PARTITION_ROWS 8192
+// More than any calibrated small merge, so the radix path runs
+#define OTHER_ROWS 16384
+
+static void test_dedup_full_partition(void) {
+    HashSet* set = hashset_create(1);
+    needle_info* needle = prepare_needle("a");
+    ResultContainer* rc = hashset_create_handle(set, "a", 0, needle, needle);
+
+    // pairs share a hash, the odd row of each pair scores higher
+    for (int i = 0; i < PARTITION_ROWS; i++) {
+        const uint32_t hash = (uint32_t)(i / 2 + 1) << 8 | 0x01;
+        result_container_add_lazy(rc, hash, i % 2 ? 100 : 50, row_match, ROW_DATA(i), NULL);
+    }
+    for (int i = 0; i < OTHER_ROWS; i++) {
+        const uint32_t hash = (uint32_t)(i + 1) << 8 | (2 + i % 254);
+        result_container_add_lazy(rc, hash, 0, row_match, ROW_DATA(PARTITION_ROWS + i), NULL);
+    }
+    container_flush_items(rc);
+    container_return_sheet(set, rc);
+    container_destroy(rc);
+
+    merge_on_this_thread(set);
+    g_assert_cmpint(set->size, ==, PARTITION_ROWS / 2 + OTHER_ROWS);
+
+    uint8_t seen[PARTITION_ROWS / 2] = {0};
+    for (int i = 0; i < set->size; i++) {
+        const int id = ROW_ID(hashset_get_match_at(set, i));
+        g_assert_cmpint(id, >=, 0);
+        if (id >= PARTITION_ROWS) continue;
+
+        g_assert_cmpint(id % 2, ==, 1);
+        g_assert_cmpint(seen[id / 2]++, ==, 0);
+    }
+
+    free_string_info(needle);
+    hashset_destroy(set);
+}
+
+// Cached sets are only served for the exact provider list they were searched
+// with, and a provider with new contents evicts what was cached before
+static void test_cache_exact_providers(void) {
+    static int provider_a, provider_b;
+    HashSet* set = hashset_create(1);
+
+    const CacheProvider both[] = {{&provider_a, 0}, {&provider_b, 0}};
+    const CacheProvider swapped[] = {{&provider_b, 0}, {&provider_a, 0}};
+    const CacheProvider only_a[] = {{&provider_a, 0}};
+    const CacheProvider changed_b[] = {{&provider_b, 1}};
+    hashset_cache_insert(1, both, 2, "query", set);
+
+    g_assert_true(hashset_cache_lookup(1, swapped, 2, "query") == NULL);
+    g_assert_true(hashset_cache_lookup(1, only_a, 1, "query") == NULL);
+    g_assert_true(hashset_cache_lookup(2, both, 2, "query") == NULL);
+
+    HashSet* cached = hashset_cache_lookup(1, both, 2, "query");
+    g_assert_true(cached == set);
+    hashset_destroy(cached);
+
+    g_assert_true(hashset_cache_lookup(1, changed_b, 1, "query") == NULL);
+    g_assert_true(hashset_cache_lookup(1, both, 2, "query") == NULL);
+
+    hashset_cache_clear();
+    hashset_destroy(set);
+}
+
+int main(int argc, char** argv) {
+    g_test_init(&argc, &argv, NULL);
+    thread_pool_init(1);
+    hashset_init(1);
+
+    g_test_add_func("/hashset/dedup-full-partition", test_dedup_full_partition);
+    g_test_add_func("/hashset/cache-exact-providers", test_cache_exact_providers);
+    return g_test_run();
+}
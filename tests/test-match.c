@@ -0,0 +1,41 @@
+// Tests for the fzy matcher: which haystacks a needle matches.
+
+#include <glib.h>
+
+#include "match.h"
+
+static void assert_matches(const char* query, const char* haystack, bool expected) {
+    needle_info* needle = prepare_needle(query);
+    g_assert_nonnull(needle);
+
+    g_assert_cmpint(query_has_match(needle, haystack), ==, expected);
+    if (expected) {
+        g_assert_cmpint(match_score(needle, haystack), >, SCORE_BELOW_THRESHOLD);
+    } else {
+        g_assert_cmpint(match_score(needle, haystack), <=, SCORE_BELOW_THRESHOLD);
+    }
+    free_string_info(needle);
+}
+
+// A query of only spaces has no tokens, it matches its spaces literally
+static void test_spaces_only(void) {
+    assert_matches(" ", "abc", false);
+    assert_matches(" ", "xyz", false);
+    assert_matches(" ", "a b", true);
+    assert_matches("  ", "a b", false);
+    assert_matches("  ", "a b c", true);
+}
+
+static void test_tokens_any_order(void) {
+    assert_matches("ab cd", "cd ab", true);
+    assert_matches(" ab  cd ", "xcdxabx", true);
+    assert_matches("ab cd", "abc", false);
+}
+
+int main(int argc, char** argv) {
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/match/spaces-only", test_spaces_only);
+    g_test_add_func("/match/tokens-any-order", test_tokens_any_order);
+    return g_test_run();
+}
@@ -0,0 +1,61 @@
+// Tests for how result containers store scores: several providers fill one
+// set, each through its own container with the provider's bonus.
+
+#include <stdint.h>
+#include <glib.h>
+
+#include "hashset.h"
+#include "match.h"
+
+extern void thread_pool_init(uint16_t n);
+
+#define ROW_DATA(id) ((void*)(uintptr_t)(((id) + 1) << 4))
+#define ROW_ID(match) ((int)((uintptr_t)(match) >> 4) - 1)
+
+enum { STRICT_WEAK, STRICT_STRONG, TYPO_CLOSE, TYPO_FAR };
+
+static BobLauncherMatch* row_match(void* user_data) {
+    return user_data;
+}
+
+static void add_row(HashSet* set, needle_info* needle, int16_t bonus, int id, int32_t score) {
+    ResultContainer* rc = hashset_create_handle(set, "typo", bonus, needle, needle);
+    result_container_add_lazy_unique(rc, score, row_match, ROW_DATA(id), NULL);
+    container_flush_items(rc);
+    container_return_sheet(set, rc);
+    container_destroy(rc);
+}
+
+// The bonus of the provider that found a typo match must not lift it over
+// a strict match of a provider with a lower bonus
+static void test_typo_below_bonus(void) {
+    HashSet* set = hashset_create(1);
+    needle_info* needle = prepare_needle("typo");
+
+    add_row(set, needle, -200, STRICT_WEAK, SCORE_STRICT_MIN);
+    add_row(set, needle, -200, STRICT_STRONG, 0);
+    add_row(set, needle, 500, TYPO_CLOSE, SCORE_TYPO(1));
+    add_row(set, needle, 500, TYPO_FAR, SCORE_TYPO(MATCH_TYPO_MAX));
+
+    hashset_seal(set);
+    hashset_plan_merge(set);
+    merge_hashset_parallel(set, 0);
+
+    g_assert_cmpint(set->size, ==, 4);
+    g_assert_cmpint(ROW_ID(hashset_get_match_at(set, 0)), ==, STRICT_STRONG);
+    g_assert_cmpint(ROW_ID(hashset_get_match_at(set, 1)), ==, STRICT_WEAK);
+    g_assert_cmpint(ROW_ID(hashset_get_match_at(set, 2)), ==, TYPO_CLOSE);
+    g_assert_cmpint(ROW_ID(hashset_get_match_at(set, 3)), ==, TYPO_FAR);
+
+    free_string_info(needle);
+    hashset_destroy(set);
+}
+
+int main(int argc, char** argv) {
+    g_test_init(&argc, &argv, NULL);
+    thread_pool_init(1);
+    hashset_init(1);
+
+    g_test_add_func("/result-container/typo-below-bonus", test_typo_below_bonus);
+    return g_test_run();
+}